@@ -0,0 +1,1525 @@
+//
+// socks_bench.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Load generator for socks_server.
+//
+// Starts socks_server on a free loopback port (or uses one given with
+// --proxy), runs local echo and sink servers behind it and drives them with
+// blocking SOCKS4/4A and SOCKS5 clients on several threads. Every scenario
+// appends one JSON object per line to the output file.
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <getopt.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <boost/asio.hpp>
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+using namespace std;
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned int DWORD;
+typedef std::chrono::steady_clock bench_clock;
+
+struct bench_config {
+  string server = "./socks_server";
+  vector<string> server_args;
+  int proxy_port = 0;  // 0: start our own server
+  int threads = 4;
+  double duration = 3.0;
+  size_t bulk_mb = 1024;
+  int bulk_streams = 4;
+  size_t idle_tunnels = 5000;
+  string out = "bench_output.txt";
+  bool append = false;
+  bool check = false;  // exit 1 if a scenario fails or is skipped
+  vector<string> scenarios;
+};
+
+static bench_config g_config;
+
+// Blocking socket helpers
+
+static int tcp_connect(int port)
+{
+  struct sockaddr_in sa;
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int one = 1;
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// Close with RST so a storm doesn't leave the client side in TIME_WAIT
+static void abort_close(int fd)
+{
+  struct linger lg = { 1, 0 };
+
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  close(fd);
+}
+
+static bool write_full(int fd, const char *data, size_t length)
+{
+  while (length) {
+    ssize_t n = write(fd, data, length);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool read_full(int fd, char *data, size_t length)
+{
+  while (length) {
+    ssize_t n = read(fd, data, length);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Sends a SOCKS4 (or SOCKS4A when host is set) request, reply goes to reply
+static bool socks4_request(int fd, BYTE cd, int port, const char *host, char reply[8])
+{
+  char req[0x200];
+  size_t length = 0;
+
+  req[length++] = 4;
+  req[length++] = cd;
+  req[length++] = (port >> 8) & 0xff;
+  req[length++] = port & 0xff;
+  if (host) {
+    req[length++] = 0;
+    req[length++] = 0;
+    req[length++] = 0;
+    req[length++] = 1;
+  } else {
+    req[length++] = 127;
+    req[length++] = 0;
+    req[length++] = 0;
+    req[length++] = 1;
+  }
+  memcpy(&req[length], "bench", 6);
+  length += 6;
+  if (host) {
+    size_t n = strlen(host) + 1;
+    memcpy(&req[length], host, n);
+    length += n;
+  }
+
+  if (!write_full(fd, req, length)) {
+    return false;
+  }
+  if (!read_full(fd, reply, 8)) {
+    return false;
+  }
+  return reply[1] == 90;
+}
+
+static int proxy_connect(int dst_port, const char *host = NULL)
+{
+  char reply[8];
+  int fd = tcp_connect(g_config.proxy_port);
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (!socks4_request(fd, 1, dst_port, host, reply)) {
+    abort_close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// SOCKS5 UDP ASSOCIATE on fd, relay is set to the address datagrams go to
+static bool socks5_udp_associate(int fd, sockaddr_in& relay)
+{
+  const char req[] = { 5, 1, 0, 5, 3, 0, 1, 0, 0, 0, 0, 0, 0 };
+  char reply[2 + 10];
+
+  if (!write_full(fd, req, sizeof(req)) || !read_full(fd, reply, sizeof(reply))) {
+    return false;
+  }
+  if (reply[1] != 0 || reply[3] != 0 || reply[5] != 1) {
+    return false;
+  }
+
+  memset(&relay, 0, sizeof(relay));
+  relay.sin_family = AF_INET;
+  memcpy(&relay.sin_addr, reply + 6, 4);
+  memcpy(&relay.sin_port, reply + 10, 2);
+  return true;
+}
+
+static double elapsed_sec(bench_clock::time_point start)
+{
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static double elapsed_us(bench_clock::time_point start)
+{
+  return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+// Echo and sink servers behind the proxy
+
+class target_servers
+{
+public:
+  target_servers()
+    : echo_(io_context_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+      sink_(io_context_, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+      udp_echo_(io_context_, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+      dns_(io_context_, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+      dns_strand_(io_context_.get_executor()),
+      sunk_(0),
+      dns_queries_(0),
+      dns_drop_every_(0)
+  {
+    do_accept(echo_, true);
+    do_accept(sink_, false);
+    do_udp_echo();
+    do_dns();
+    for (int i = 0; i < 2; ++i) {
+      threads_.emplace_back([this]() { io_context_.run(); });
+    }
+  }
+
+  ~target_servers()
+  {
+    io_context_.stop();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  int echo_port() const
+  {
+    return echo_.local_endpoint().port();
+  }
+
+  int sink_port() const
+  {
+    return sink_.local_endpoint().port();
+  }
+
+  int udp_echo_port() const
+  {
+    return udp_echo_.local_endpoint().port();
+  }
+
+  int dns_port() const
+  {
+    return dns_.local_endpoint().port();
+  }
+
+  // Queries the stub DNS server has seen
+  uint64_t dns_queries() const
+  {
+    return dns_queries_.load();
+  }
+
+  // The stub ignores every n-th query, 0 answers all of them
+  void set_dns_drop_every(uint64_t n)
+  {
+    dns_drop_every_ = n;
+  }
+
+  // Bytes the sink has received so far
+  uint64_t sunk() const
+  {
+    return sunk_.load();
+  }
+
+private:
+  class connection
+    : public std::enable_shared_from_this<connection>
+  {
+  public:
+    connection(tcp::socket socket, bool echo, std::atomic<uint64_t>& sunk)
+      : socket_(std::move(socket)),
+        echo_(echo),
+        sunk_(sunk)
+    {
+    }
+
+    void do_read()
+    {
+      auto self(shared_from_this());
+      socket_.async_read_some(boost::asio::buffer(data_, sizeof(data_)),
+        [this, self](boost::system::error_code ec, std::size_t length)
+        {
+          if (ec) {
+            return;
+          }
+          if (!echo_) {
+            sunk_ += length;
+            do_read();
+            return;
+          }
+          boost::asio::async_write(socket_, boost::asio::buffer(data_, length),
+            [this, self](boost::system::error_code ec, std::size_t /*length*/)
+            {
+              if (!ec) {
+                do_read();
+              }
+            });
+        });
+    }
+
+  private:
+    tcp::socket socket_;
+    bool echo_;
+    std::atomic<uint64_t>& sunk_;
+    char data_[0x10000];
+  };
+
+  void do_accept(tcp::acceptor& acceptor, bool echo)
+  {
+    acceptor.async_accept(
+      [this, &acceptor, echo](boost::system::error_code ec, tcp::socket socket)
+      {
+        if (!ec) {
+          socket.set_option(tcp::no_delay(true));
+          std::make_shared<connection>(std::move(socket), echo, sunk_)->do_read();
+        }
+        do_accept(acceptor, echo);
+      });
+  }
+
+  // One receive at a time, so the handlers never run concurrently
+  void do_udp_echo()
+  {
+    udp_echo_.async_receive_from(boost::asio::buffer(datagram_, sizeof(datagram_)), udp_peer_,
+      [this](boost::system::error_code ec, std::size_t length)
+      {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+        if (!ec) {
+          udp_echo_.send_to(boost::asio::buffer(datagram_, length), udp_peer_, 0, ec);
+        }
+        do_udp_echo();
+      });
+  }
+
+  // Stub DNS server: every A query gets 127.0.0.1 after dns_delay_ms, the
+  // round trip to a real upstream. Everything runs on one strand.
+  enum { dns_delay_ms = 2 };
+
+  void do_dns()
+  {
+    dns_.async_receive_from(boost::asio::buffer(dns_query_, sizeof(dns_query_)), dns_peer_,
+      boost::asio::bind_executor(dns_strand_,
+        [this](boost::system::error_code ec, std::size_t length)
+        {
+          if (ec == boost::asio::error::operation_aborted) {
+            return;
+          }
+          uint64_t n = ++dns_queries_;
+          if (!ec && length > 12 && !(dns_drop_every_ && n % dns_drop_every_ == 0)) {
+            answer_dns(length);
+          }
+          do_dns();
+        }));
+  }
+
+  void answer_dns(size_t length)
+  {
+    static const unsigned char answer[] = {
+      0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 0, 0, 4, 127, 0, 0, 1
+    };
+    std::shared_ptr<string> reply = std::make_shared<string>(dns_query_, length);
+    std::shared_ptr<boost::asio::steady_timer> delay =
+      std::make_shared<boost::asio::steady_timer>(io_context_, std::chrono::milliseconds(dns_delay_ms));
+    udp::endpoint peer = dns_peer_;
+
+    (*reply)[2] = (char)0x81;
+    (*reply)[3] = (char)0x80;
+    (*reply)[7] = 1;
+    reply->append((const char *)answer, sizeof(answer));
+
+    delay->async_wait(boost::asio::bind_executor(dns_strand_,
+      [this, reply, delay, peer](boost::system::error_code ec)
+      {
+        if (!ec) {
+          dns_.send_to(boost::asio::buffer(*reply), peer, 0, ec);
+        }
+      }));
+  }
+
+  boost::asio::io_context io_context_;
+  tcp::acceptor echo_;
+  tcp::acceptor sink_;
+  udp::socket udp_echo_;
+  udp::endpoint udp_peer_;
+  char datagram_[0x10000];
+  udp::socket dns_;
+  boost::asio::strand<boost::asio::io_context::executor_type> dns_strand_;
+  udp::endpoint dns_peer_;
+  char dns_query_[512];
+  std::atomic<uint64_t> sunk_;
+  std::atomic<uint64_t> dns_queries_;
+  std::atomic<uint64_t> dns_drop_every_;
+  vector<std::thread> threads_;
+};
+
+// Results
+
+class result
+{
+public:
+  explicit result(const string& scenario)
+    : skipped_(false), failed_(false)
+  {
+    os_.precision(12);
+    os_ << "{\"scenario\":\"" << scenario << "\"";
+  }
+
+  result& add(const string& key, double value)
+  {
+    os_ << ",\"" << key << "\":" << value;
+    return *this;
+  }
+
+  result& add(const string& key, const string& value)
+  {
+    os_ << ",\"" << key << "\":\"" << value << "\"";
+    return *this;
+  }
+
+  result& skip(const string& reason)
+  {
+    skipped_ = true;
+    return add("skipped", reason);
+  }
+
+  // A scenario that measured something it promises not to do
+  result& fail(const string& reason)
+  {
+    failed_ = true;
+    return add("failed", reason);
+  }
+
+  bool skipped() const
+  {
+    return skipped_;
+  }
+
+  bool failed() const
+  {
+    return failed_;
+  }
+
+  string str() const
+  {
+    return os_.str() + "}";
+  }
+
+private:
+  ostringstream os_;
+  bool skipped_;
+  bool failed_;
+};
+
+struct latency_stats {
+  void add(double us)
+  {
+    samples.push_back(us);
+  }
+
+  void merge(const latency_stats& other)
+  {
+    samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+  }
+
+  double percentile(double p)
+  {
+    if (samples.empty()) {
+      return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t idx = std::min(samples.size() - 1, (size_t)(p / 100.0 * samples.size()));
+    return samples[idx];
+  }
+
+  vector<double> samples;
+};
+
+// Runs fn(thread index) on every client thread and merges their latencies
+static latency_stats run_clients(std::function<void(int, latency_stats&)> fn)
+{
+  vector<std::thread> threads;
+  vector<latency_stats> stats(g_config.threads);
+  latency_stats all;
+
+  for (int i = 0; i < g_config.threads; ++i) {
+    threads.emplace_back([&fn, &stats, i]() { fn(i, stats[i]); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& s : stats) {
+    all.merge(s);
+  }
+  return all;
+}
+
+// Scenarios
+
+// New tunnels per second: connect, CONNECT request, close
+static void bench_connect_storm(target_servers& targets, result& r)
+{
+  std::atomic<uint64_t> ok(0);
+  std::atomic<uint64_t> errors(0);
+  bench_clock::time_point start = bench_clock::now();
+
+  run_clients([&](int, latency_stats&)
+    {
+      while (elapsed_sec(start) < g_config.duration) {
+        int fd = proxy_connect(targets.sink_port());
+        if (fd == -1) {
+          ++errors;
+          continue;
+        }
+        abort_close(fd);
+        ++ok;
+      }
+    });
+
+  double sec = elapsed_sec(start);
+  r.add("connects_per_sec", ok / sec).add("errors", (double)errors);
+}
+
+// Long-lived streams pushing data into the sink
+static void bench_bulk(target_servers& targets, result& r)
+{
+  size_t per_stream = (g_config.bulk_mb << 20) / g_config.bulk_streams;
+  uint64_t base = targets.sunk();
+  std::atomic<uint64_t> errors(0);
+  vector<std::thread> threads;
+  vector<int> fds;
+  bench_clock::time_point start = bench_clock::now();
+
+  for (int i = 0; i < g_config.bulk_streams; ++i) {
+    threads.emplace_back([&]()
+      {
+        vector<char> chunk(0x40000, 'x');
+        int fd = proxy_connect(targets.sink_port());
+        size_t left = per_stream;
+
+        if (fd == -1) {
+          ++errors;
+          return;
+        }
+        while (left) {
+          size_t n = std::min(left, chunk.size());
+          if (!write_full(fd, chunk.data(), n)) {
+            ++errors;
+            break;
+          }
+          left -= n;
+        }
+        // Closed only once the sink has everything, the proxy drops the
+        // tunnel on EOF
+        while (targets.sunk() - base < per_stream * g_config.bulk_streams &&
+               elapsed_sec(start) < 120) {
+          usleep(1000);
+        }
+        close(fd);
+      });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  double sec = elapsed_sec(start);
+  double bytes = targets.sunk() - base;
+  r.add("streams", g_config.bulk_streams)
+   .add("bytes", bytes)
+   .add("gbit_per_sec", bytes * 8 / sec / 1e9)
+   .add("errors", (double)errors);
+}
+
+// Small request/response round trips over established tunnels
+static void bench_round_trip(target_servers& targets, result& r)
+{
+  bench_clock::time_point start = bench_clock::now();
+  std::atomic<uint64_t> errors(0);
+
+  latency_stats lat = run_clients([&](int, latency_stats& stats)
+    {
+      char buf[64];
+      int fd = proxy_connect(targets.echo_port());
+
+      if (fd == -1) {
+        ++errors;
+        return;
+      }
+      memset(buf, 'r', sizeof(buf));
+      while (elapsed_sec(start) < g_config.duration) {
+        bench_clock::time_point t = bench_clock::now();
+        if (!write_full(fd, buf, sizeof(buf)) || !read_full(fd, buf, sizeof(buf))) {
+          ++errors;
+          break;
+        }
+        stats.add(elapsed_us(t));
+      }
+      close(fd);
+    });
+
+  double sec = elapsed_sec(start);
+  r.add("round_trips_per_sec", lat.samples.size() / sec)
+   .add("p50_us", lat.percentile(50))
+   .add("p99_us", lat.percentile(99))
+   .add("errors", (double)errors);
+}
+
+// Time from connect to the SOCKS reply, SOCKS4 with an address against
+// SOCKS4A with a name
+static void bench_request(target_servers& targets, result& r)
+{
+  const char *hosts[] = { NULL, "localhost" };
+  const char *names[] = { "socks4", "socks4a" };
+
+  for (int i = 0; i < 2; ++i) {
+    const char *host = hosts[i];
+    bench_clock::time_point start = bench_clock::now();
+    std::atomic<uint64_t> errors(0);
+
+    latency_stats lat = run_clients([&](int, latency_stats& stats)
+      {
+        while (elapsed_sec(start) < g_config.duration / 2) {
+          bench_clock::time_point t = bench_clock::now();
+          int fd = proxy_connect(targets.sink_port(), host);
+          if (fd == -1) {
+            ++errors;
+            continue;
+          }
+          stats.add(elapsed_us(t));
+          abort_close(fd);
+        }
+      });
+
+    r.add(string(names[i]) + "_p50_us", lat.percentile(50))
+     .add(string(names[i]) + "_p99_us", lat.percentile(99))
+     .add(string(names[i]) + "_errors", (double)errors);
+  }
+}
+
+// BIND round: request a port, connect to it from the "server" side and
+// exchange a message each way
+static void bench_bind(target_servers& /*targets*/, result& r)
+{
+  bench_clock::time_point start = bench_clock::now();
+  std::atomic<uint64_t> errors(0);
+
+  latency_stats lat = run_clients([&](int, latency_stats& stats)
+    {
+      while (elapsed_sec(start) < g_config.duration) {
+        bench_clock::time_point t = bench_clock::now();
+        char reply[8];
+        char buf[4];
+        int fd = tcp_connect(g_config.proxy_port);
+        int peer = -1;
+        bool ok = fd != -1 && socks4_request(fd, 2, 1, NULL, reply);
+
+        if (ok) {
+          int port = ((BYTE)reply[2] << 8) | (BYTE)reply[3];
+          peer = tcp_connect(port);
+          ok = peer != -1 &&
+               read_full(fd, reply, 8) && reply[1] == 90 &&
+               write_full(peer, "ping", 4) && read_full(fd, buf, 4) &&
+               write_full(fd, "pong", 4) && read_full(peer, buf, 4);
+        }
+
+        if (ok) {
+          stats.add(elapsed_us(t));
+        } else {
+          ++errors;
+        }
+        if (peer != -1) {
+          abort_close(peer);
+        }
+        if (fd != -1) {
+          abort_close(fd);
+        }
+      }
+    });
+
+  double sec = elapsed_sec(start);
+  r.add("binds_per_sec", lat.samples.size() / sec)
+   .add("p50_us", lat.percentile(50))
+   .add("p99_us", lat.percentile(99))
+   .add("errors", (double)errors);
+}
+
+// SOCKS5 UDP ASSOCIATE: every client keeps a window of datagrams in flight
+// to the UDP echo server. A datagram not back within 200ms counts as lost.
+static void bench_udp(target_servers& targets, result& r)
+{
+  enum { window = 32, payload = 512 };
+  bench_clock::time_point start = bench_clock::now();
+  std::atomic<uint64_t> echoed(0);
+  std::atomic<uint64_t> lost(0);
+  std::atomic<uint64_t> errors(0);
+
+  latency_stats lat = run_clients([&](int, latency_stats& stats)
+    {
+      char datagram[10 + payload];
+      char buf[0x1000];
+      sockaddr_in relay;
+      timeval timeout = { 0, 200000 };
+      int fd = tcp_connect(g_config.proxy_port);
+      int u = socket(AF_INET, SOCK_DGRAM, 0);
+
+      if (fd == -1 || u == -1 || !socks5_udp_associate(fd, relay)) {
+        ++errors;
+        if (fd != -1) {
+          close(fd);
+        }
+        if (u != -1) {
+          close(u);
+        }
+        return;
+      }
+      setsockopt(u, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+      // RSV RSV FRAG ATYP=1 127.0.0.1 port
+      int port = targets.udp_echo_port();
+      const char header[] = { 0, 0, 0, 1, 127, 0, 0, 1, (char)(port >> 8), (char)(port & 0xff) };
+      memcpy(datagram, header, sizeof(header));
+      memset(datagram + sizeof(header), 'u', payload);
+
+      while (elapsed_sec(start) < g_config.duration) {
+        bench_clock::time_point t = bench_clock::now();
+        int received = 0;
+
+        for (int i = 0; i < window; ++i) {
+          sendto(u, datagram, sizeof(datagram), 0, (sockaddr *)&relay, sizeof(relay));
+        }
+        while (received < window && recv(u, buf, sizeof(buf), 0) > 0) {
+          ++received;
+        }
+        echoed += received;
+        lost += window - received;
+        stats.add(elapsed_us(t));
+      }
+      close(u);
+      close(fd);
+    });
+
+  double sec = elapsed_sec(start);
+  r.add("datagram_bytes", payload)
+   .add("window", window)
+   .add("echoed_per_sec", echoed / sec)
+   .add("lost", (double)lost)
+   .add("window_p50_us", lat.percentile(50))
+   .add("window_p99_us", lat.percentile(99))
+   .add("errors", (double)errors);
+}
+
+// socks_server under test
+
+class server_process
+{
+public:
+  server_process()
+    : pid_(-1)
+  {
+  }
+
+  ~server_process()
+  {
+    stop();
+  }
+
+  // Listens on a free port with a permit-all rule set, extra goes after the
+  // user's server arguments
+  bool start(const vector<string>& extra = vector<string>())
+  {
+    char conf[] = "/tmp/socks_bench_conf_XXXXXX";
+    int fd = mkstemp(conf);
+
+    if (fd == -1) {
+      return false;
+    }
+    conf_ = conf;
+    write_full(fd, default_rules(), strlen(default_rules()));
+    close(fd);
+
+    port_ = free_port();
+
+    vector<string> args;
+    args.push_back(g_config.server);
+    args.push_back(std::to_string(port_));
+    args.push_back("-c");
+    args.push_back(conf_);
+    args.push_back("--access-log");
+    args.push_back("none");
+    args.insert(args.end(), g_config.server_args.begin(), g_config.server_args.end());
+    args.insert(args.end(), extra.begin(), extra.end());
+
+    pid_ = fork();
+    if (pid_ == 0) {
+      vector<char *> argv;
+      int devnull = open("/dev/null", O_WRONLY);
+
+      dup2(devnull, STDOUT_FILENO);
+      for (string& arg : args) {
+        argv.push_back(&arg[0]);
+      }
+      argv.push_back(NULL);
+      execv(argv[0], argv.data());
+      _exit(127);
+    }
+    if (pid_ == -1) {
+      return false;
+    }
+
+    // Wait until it accepts
+    for (int i = 0; i < 200; ++i) {
+      int probe = tcp_connect(port_);
+      if (probe != -1) {
+        close(probe);
+        return true;
+      }
+      usleep(10000);
+    }
+    return false;
+  }
+
+  void stop()
+  {
+    if (pid_ > 0) {
+      int status;
+      kill(pid_, SIGTERM);
+      waitpid(pid_, &status, 0);
+      pid_ = -1;
+    }
+    if (!conf_.empty()) {
+      unlink(conf_.c_str());
+      conf_.clear();
+    }
+  }
+
+  // Rewrites socks.conf and has the server reload it
+  // settle_us is how long the server gets to parse the file
+  bool reconfigure(const string& rules, useconds_t settle_us = 200000)
+  {
+    ofstream conf(conf_, ios::trunc);
+
+    conf << rules;
+    conf.close();
+    if (!conf || kill(pid_, SIGHUP) == -1) {
+      return false;
+    }
+    usleep(settle_us);
+    return true;
+  }
+
+  static const char *default_rules()
+  {
+    return "permit c *.*.*.*\npermit b *.*.*.*\npermit u *.*.*.*\n";
+  }
+
+  pid_t pid() const
+  {
+    return pid_;
+  }
+
+  int port() const
+  {
+    return port_;
+  }
+
+  static int free_port()
+  {
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    return acceptor.local_endpoint().port();
+  }
+
+private:
+  pid_t pid_;
+  int port_;
+  string conf_;
+};
+
+// Set when the bench started the server itself
+static server_process *g_server = NULL;
+
+// Bytes per second the sink receives over bulk_streams tunnels in `sec`
+static double stream_rate(target_servers& targets, double sec)
+{
+  std::atomic<bool> done(false);
+  vector<std::thread> threads;
+
+  for (int i = 0; i < g_config.bulk_streams; ++i) {
+    threads.emplace_back([&]()
+      {
+        vector<char> chunk(0x10000, 'x');
+        int fd = proxy_connect(targets.sink_port());
+
+        if (fd == -1) {
+          return;
+        }
+        while (!done && write_full(fd, chunk.data(), chunk.size())) {}
+        abort_close(fd);
+      });
+  }
+
+  // Tunnels are up once the first bytes arrive
+  uint64_t base = targets.sunk();
+  while (targets.sunk() == base) {
+    usleep(1000);
+  }
+  base = targets.sunk();
+  usleep(sec * 1e6);
+  double rate = (targets.sunk() - base) / sec;
+
+  done = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return rate;
+}
+
+// Bulk throughput without limits, with limits that are never reached and
+// with one that is
+static void bench_shaper(target_servers& targets, result& r)
+{
+  const string base = server_process::default_rules();
+  const uint64_t limit = 10 << 20;
+
+  if (!g_server) {
+    r.skip("needs a server started by socks_bench");
+    return;
+  }
+
+  g_server->reconfigure(base);
+  double unlimited = stream_rate(targets, g_config.duration);
+
+  g_server->reconfigure(base + "limit client *.*.*.* 100g\nlimit user * 100g\nlimit dest *.*.*.* 100g\n");
+  double not_hit = stream_rate(targets, g_config.duration);
+
+  g_server->reconfigure(base + "limit client *.*.*.* " + std::to_string(limit) + "\n");
+  double limited = stream_rate(targets, g_config.duration);
+
+  g_server->reconfigure(base);
+
+  r.add("streams", g_config.bulk_streams)
+   .add("unlimited_gbit_per_sec", unlimited * 8 / 1e9)
+   .add("not_hit_gbit_per_sec", not_hit * 8 / 1e9)
+   .add("not_hit_overhead_pct", (unlimited - not_hit) / unlimited * 100)
+   .add("limit_bytes_per_sec", limit)
+   .add("limited_bytes_per_sec", limited);
+}
+
+// n rules that never match the sink: prefixes in 10/8, some of them only
+// for one port, followed by the rule that lets the bench through. The port
+// range keeps the firewall from caching decisions, so every request walks
+// the rule set.
+static string acl_rules(size_t n)
+{
+  static const int lengths[] = { 8, 16, 20, 24, 24, 28, 32, 32 };
+  std::mt19937 rng(n);
+  ostringstream os;
+
+  for (size_t i = 1; i < n; ++i) {
+    int length = lengths[rng() % (sizeof(lengths) / sizeof(lengths[0]))];
+    uint32_t addr = (10u << 24 | (rng() & 0xffffff)) & (~0u << (32 - length));
+
+    os << "deny c " << (addr >> 24) << "." << ((addr >> 16) & 0xff) << "."
+       << ((addr >> 8) & 0xff) << "." << (addr & 0xff) << "/" << length;
+    if (i % 8 == 0) {
+      os << " port " << 1 + rng() % 1024;
+    }
+    os << "\n";
+  }
+  os << "permit c 127.0.0.0/8 port 1-65535\n";
+  return os.str();
+}
+
+// CONNECT latency as the rule set grows
+static void bench_acl(target_servers& targets, result& r)
+{
+  static const size_t sizes[] = { 10, 1000, 10000, 100000 };
+
+  if (!g_server) {
+    r.skip("needs a server started by socks_bench");
+    return;
+  }
+
+  for (size_t n : sizes) {
+    bench_clock::time_point start;
+    std::atomic<uint64_t> ok(0);
+    std::atomic<uint64_t> errors(0);
+
+    g_server->reconfigure(acl_rules(n), 200000 + n * 20);
+    start = bench_clock::now();
+
+    latency_stats lat = run_clients([&](int, latency_stats& stats)
+      {
+        while (elapsed_sec(start) < g_config.duration / 2) {
+          bench_clock::time_point t = bench_clock::now();
+          int fd = proxy_connect(targets.sink_port());
+          if (fd == -1) {
+            ++errors;
+            continue;
+          }
+          stats.add(elapsed_us(t));
+          abort_close(fd);
+          ++ok;
+        }
+      });
+
+    string name = "rules_" + std::to_string(n);
+    r.add(name + "_per_sec", ok / elapsed_sec(start))
+     .add(name + "_p50_us", lat.percentile(50))
+     .add(name + "_p99_us", lat.percentile(99))
+     .add(name + "_errors", (double)errors);
+  }
+
+  g_server->reconfigure(server_process::default_rules());
+}
+
+// SOCKS4A requests for names nobody asked for before, resolved by a second
+// server instance through the stub DNS server instead of getaddrinfo. The
+// lossy round drops a share of the queries so retries show in the tail.
+static void bench_dns(target_servers& targets, result& r)
+{
+  static const struct {
+    const char *name;
+    uint64_t drop_every;
+  } rounds[] = { { "dns", 0 }, { "lossy", 20 } };
+
+  if (!g_server) {
+    r.skip("needs a server started by socks_bench");
+    return;
+  }
+
+  server_process server;
+  vector<string> extra;
+
+  extra.push_back("--dns-server");
+  extra.push_back("127.0.0.1:" + std::to_string(targets.dns_port()));
+  extra.push_back("--dns-timeout");
+  extra.push_back("200");
+  extra.push_back("--dns-ttl");
+  extra.push_back("0");
+  if (!server.start(extra)) {
+    r.skip("can't start a server with --dns-server");
+    return;
+  }
+
+  for (const auto& round : rounds) {
+    bench_clock::time_point start = bench_clock::now();
+    std::atomic<uint64_t> ok(0);
+    std::atomic<uint64_t> errors(0);
+    uint64_t queries = targets.dns_queries();
+
+    targets.set_dns_drop_every(round.drop_every);
+
+    latency_stats lat = run_clients([&](int thread, latency_stats& stats)
+      {
+        char reply[8];
+
+        for (uint64_t i = 0; elapsed_sec(start) < g_config.duration / 2; ++i) {
+          string host = "h" + std::to_string(i) + "-" + std::to_string(thread) + "." + round.name + ".bench";
+          bench_clock::time_point t = bench_clock::now();
+          int fd = tcp_connect(server.port());
+
+          if (fd == -1 || !socks4_request(fd, 1, targets.sink_port(), host.c_str(), reply)) {
+            ++errors;
+            if (fd != -1) {
+              abort_close(fd);
+            }
+            continue;
+          }
+          stats.add(elapsed_us(t));
+          abort_close(fd);
+          ++ok;
+        }
+      });
+
+    double sec = elapsed_sec(start);
+    string name = round.name;
+    r.add(name + "_resolves_per_sec", ok / sec)
+     .add(name + "_p50_us", lat.percentile(50))
+     .add(name + "_p99_us", lat.percentile(99))
+     .add(name + "_queries", (double)(targets.dns_queries() - queries))
+     .add(name + "_errors", (double)errors);
+  }
+
+  targets.set_dns_drop_every(0);
+}
+
+// Proportional set size of pid and everything below it, in bytes. Pages
+// shared between forked children are split among them, so fork and threaded
+// mode can be compared.
+static uint64_t tree_pss(pid_t pid)
+{
+  vector<std::pair<pid_t, pid_t>> parents;  // (ppid, pid)
+  vector<pid_t> pids(1, pid);
+  uint64_t total = 0;
+
+  // The parent is the fourth field of /proc/<pid>/stat, after the
+  // parenthesized command name
+  if (DIR *proc = opendir("/proc")) {
+    while (dirent *e = readdir(proc)) {
+      pid_t child = std::atoi(e->d_name);
+      ifstream stat("/proc/" + string(e->d_name) + "/stat");
+      string line;
+      int ppid = 0;
+
+      if (child <= 0 || !getline(stat, line)) {
+        continue;
+      }
+      size_t paren = line.rfind(')');
+      if (paren != string::npos && sscanf(line.c_str() + paren + 1, " %*c %d", &ppid) == 1) {
+        parents.push_back(std::make_pair((pid_t)ppid, child));
+      }
+    }
+    closedir(proc);
+  }
+  std::sort(parents.begin(), parents.end());
+
+  for (size_t i = 0; i < pids.size(); ++i) {
+    ifstream rollup("/proc/" + std::to_string(pids[i]) + "/smaps_rollup");
+    string key;
+    uint64_t kb;
+
+    while (rollup >> key) {
+      if (key == "Pss:" && rollup >> kb) {
+        total += kb * 1024;
+        break;
+      }
+      rollup.ignore(256, '\n');
+    }
+
+    auto it = std::lower_bound(parents.begin(), parents.end(), std::make_pair(pids[i], (pid_t)0));
+    for (; it != parents.end() && it->first == pids[i]; ++it) {
+      pids.push_back(it->second);
+    }
+  }
+  return total;
+}
+
+// Server memory per idle tunnel: --idle-tunnels CONNECTs to the sink are
+// opened and left quiet, the growth of the server's PSS is divided among
+// them. Socket buffers live in the kernel and are not counted.
+static void bench_memory(target_servers& targets, result& r)
+{
+  vector<int> fds;
+  uint64_t before;
+  uint64_t after;
+  size_t errors = 0;
+
+  if (!g_server) {
+    r.skip("needs a server started by socks_bench");
+    return;
+  }
+
+  before = tree_pss(g_server->pid());
+  fds.reserve(g_config.idle_tunnels);
+  bench_clock::time_point start = bench_clock::now();
+
+  // Fork mode opens a process per tunnel, it gets ten scenario lengths
+  while (fds.size() < g_config.idle_tunnels && errors < 100 && elapsed_sec(start) < g_config.duration * 10) {
+    int fd = proxy_connect(targets.sink_port());
+    if (fd == -1) {
+      ++errors;
+      continue;
+    }
+    fds.push_back(fd);
+  }
+
+  double sec = elapsed_sec(start);
+  usleep(500000);
+  after = tree_pss(g_server->pid());
+
+  for (int fd : fds) {
+    abort_close(fd);
+  }
+
+  double per_tunnel = fds.empty() || after < before ? 0 : (double)(after - before) / fds.size();
+  r.add("tunnels", (double)fds.size())
+   .add("open_per_sec", fds.size() / sec)
+   .add("pss_before_bytes", (double)before)
+   .add("pss_after_bytes", (double)after)
+   .add("bytes_per_tunnel", per_tunnel)
+   .add("gb_per_million_tunnels", per_tunnel * 1e6 / 1e9)
+   .add("errors", (double)errors);
+
+  // Let the server close its side before the next scenario
+  usleep(500000);
+}
+
+// One value from the server's /metrics, -1 when it can't be read
+static double scrape(int metrics_port, const string& name)
+{
+  const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+  int fd = tcp_connect(metrics_port);
+  string body;
+  char buf[4096];
+  ssize_t n;
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (write_full(fd, request, sizeof(request) - 1)) {
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      body.append(buf, n);
+    }
+  }
+  close(fd);
+
+  size_t pos = body.find("\n" + name + " ");
+  if (pos == string::npos) {
+    return -1;
+  }
+  return std::atof(body.c_str() + pos + name.size() + 2);
+}
+
+// Heap allocations the server makes while relaying: echo round trips over
+// established tunnels, with the server's operator new counter read before
+// and after. What a scrape costs by itself is measured and taken off. The
+// counters are per process, so fork mode, where tunnels live in children,
+// can't be measured. Any allocation in the measured window fails the
+// scenario.
+static void bench_alloc(target_servers& targets, result& r)
+{
+  static const char *counter = "socks_heap_allocations_total";
+
+  if (!g_server) {
+    r.skip("needs a server started by socks_bench");
+    return;
+  }
+
+  server_process server;
+  vector<string> extra;
+  int metrics_port = server_process::free_port();
+
+  extra.push_back("--metrics");
+  extra.push_back("127.0.0.1:" + std::to_string(metrics_port));
+  if (!server.start(extra)) {
+    r.skip("can't start a server with --metrics");
+    return;
+  }
+
+  std::atomic<int> ready(0);
+  std::atomic<bool> measuring(false);
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> round_trips(0);
+  std::atomic<uint64_t> errors(0);
+  double before = 0;
+  double relayed = 0;
+
+  // Every client warms its tunnel up, then relays until told to stop
+  std::thread control([&]()
+    {
+      while (ready < g_config.threads) {
+        usleep(10000);
+      }
+      relayed = scrape(metrics_port, "socks_relay_bytes_total{direction=\"upstream\"}");
+      double first = scrape(metrics_port, counter);
+      before = scrape(metrics_port, counter);
+      // The scrape that reads the result allocates like this one did
+      before += before - first;
+      measuring = true;
+      usleep(g_config.duration / 2 * 1000000);
+      done = true;
+    });
+
+  run_clients([&](int, latency_stats&)
+    {
+      char buf[4096];
+      char reply[8];
+      int fd = tcp_connect(server.port());
+      bool counted = false;
+
+      if (fd == -1 || !socks4_request(fd, 1, targets.echo_port(), NULL, reply)) {
+        ++errors;
+        ++ready;
+        if (fd != -1) {
+          abort_close(fd);
+        }
+        return;
+      }
+      memset(buf, 'a', sizeof(buf));
+      for (int i = 0; !done; ++i) {
+        if (i == 100 && !counted) {
+          ++ready;
+          counted = true;
+        }
+        if (!write_full(fd, buf, sizeof(buf)) || !read_full(fd, buf, sizeof(buf))) {
+          ++errors;
+          break;
+        }
+        if (measuring) {
+          ++round_trips;
+        }
+      }
+      if (!counted) {
+        ++ready;
+      }
+      close(fd);
+    });
+  control.join();
+
+  double after = scrape(metrics_port, counter);
+  double moved = scrape(metrics_port, "socks_relay_bytes_total{direction=\"upstream\"}") - relayed;
+
+  if (after < 0) {
+    r.skip(string("the server doesn't export ") + counter);
+    return;
+  }
+  if (moved <= 0) {
+    r.skip("tunnels relay in forked children, use -t");
+    return;
+  }
+
+  // Each round trip is relayed once in each direction
+  double chunks = 2.0 * round_trips;
+  r.add("round_trips", (double)round_trips)
+   .add("allocations", after - before)
+   .add("allocations_per_chunk", chunks > 0 ? (after - before) / chunks : 0)
+   .add("errors", (double)errors);
+  if (after - before > 0) {
+    r.fail("relaying allocated");
+  } else if (errors > 0 || round_trips == 0) {
+    r.fail("clients couldn't relay");
+  }
+}
+
+struct scenario {
+  const char *name;
+  void (*run)(target_servers&, result&);
+};
+
+static const scenario scenarios[] = {
+  { "connect_storm", bench_connect_storm },
+  { "bulk",          bench_bulk },
+  { "round_trip",    bench_round_trip },
+  { "request",       bench_request },
+  { "bind",          bench_bind },
+  { "shaper",        bench_shaper },
+  { "acl",           bench_acl },
+  { "dns",           bench_dns },
+  { "memory",        bench_memory },
+  { "alloc",         bench_alloc },
+  { "udp",           bench_udp },
+};
+
+static void usage()
+{
+  cout << "Usage: socks_bench [options] [-- <socks_server options>]\n"
+       << "  -s, --server <path>     socks_server binary (default ./socks_server)\n"
+       << "  -p, --proxy <port>      use a server already listening on this port\n"
+       << "  -t, --threads <n>       client threads (default 4)\n"
+       << "  -d, --duration <sec>    length of each timed scenario (default 3)\n"
+       << "  -o, --out <file>        JSON lines output (default bench_output.txt)\n"
+       << "  -a, --append            add to the output file instead of replacing it\n"
+       << "  -c, --check             exit with 1 if a scenario fails or is skipped\n"
+       << "  -r, --run <a,b,...>     scenarios to run (default all):\n"
+       << "                          ";
+  for (const scenario& s : scenarios) {
+    cout << s.name << " ";
+  }
+  cout << "\n"
+       << "  --bulk-mb <n>           megabytes pushed by the bulk scenario (default 1024)\n"
+       << "  --bulk-streams <n>      parallel bulk streams (default 4)\n"
+       << "  --idle-tunnels <n>      tunnels held open by the memory scenario (default 5000)\n";
+}
+
+enum {
+  opt_bulk_mb = 0x100,
+  opt_bulk_streams,
+  opt_idle_tunnels,
+};
+
+static int parse_options(int argc, char* argv[])
+{
+  static const struct option long_options[] = {
+    { "server",       required_argument, 0, 's' },
+    { "proxy",        required_argument, 0, 'p' },
+    { "threads",      required_argument, 0, 't' },
+    { "duration",     required_argument, 0, 'd' },
+    { "out",          required_argument, 0, 'o' },
+    { "append",       no_argument,       0, 'a' },
+    { "check",        no_argument,       0, 'c' },
+    { "run",          required_argument, 0, 'r' },
+    { "bulk-mb",      required_argument, 0, opt_bulk_mb },
+    { "bulk-streams", required_argument, 0, opt_bulk_streams },
+    { "idle-tunnels", required_argument, 0, opt_idle_tunnels },
+    { 0, 0, 0, 0 }
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "+s:p:t:d:o:acr:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        g_config.server = optarg;
+        break;
+      case 'p':
+        g_config.proxy_port = std::atoi(optarg);
+        break;
+      case 't':
+        g_config.threads = std::max(1, std::atoi(optarg));
+        break;
+      case 'd':
+        g_config.duration = std::atof(optarg);
+        break;
+      case 'o':
+        g_config.out = optarg;
+        break;
+      case 'a':
+        g_config.append = true;
+        break;
+      case 'c':
+        g_config.check = true;
+        break;
+      case 'r': {
+        stringstream ss(optarg);
+        string name;
+        while (getline(ss, name, ',')) {
+          g_config.scenarios.push_back(name);
+        }
+        break;
+      }
+      case opt_bulk_mb:
+        g_config.bulk_mb = std::strtoul(optarg, NULL, 0);
+        break;
+      case opt_bulk_streams:
+        g_config.bulk_streams = std::max(1, std::atoi(optarg));
+        break;
+      case opt_idle_tunnels:
+        g_config.idle_tunnels = std::strtoul(optarg, NULL, 0);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  // Everything after "--" goes to socks_server
+  for (int i = optind; i < argc; ++i) {
+    g_config.server_args.push_back(argv[i]);
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if (parse_options(argc, argv) == -1) {
+    usage();
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // The memory scenario holds two descriptors per tunnel here and two in the
+  // server, which inherits the limit
+  struct rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+
+  server_process server;
+  string server_args;
+
+  for (const string& arg : g_config.server_args) {
+    server_args += (server_args.empty() ? "" : " ") + arg;
+  }
+
+  if (g_config.proxy_port == 0) {
+    if (!server.start()) {
+      cerr << "[x] Can't start " << g_config.server << endl;
+      return 1;
+    }
+    g_config.proxy_port = server.port();
+    g_server = &server;
+  }
+
+  target_servers targets;
+  ofstream out(g_config.out, g_config.append ? ios::app : ios::trunc);
+  int status = 0;
+
+  if (!out) {
+    cerr << "[x] Can't open " << g_config.out << endl;
+    return 1;
+  }
+
+  for (const scenario& s : scenarios) {
+    if (!g_config.scenarios.empty() &&
+        std::find(g_config.scenarios.begin(), g_config.scenarios.end(), s.name) == g_config.scenarios.end()) {
+      continue;
+    }
+
+    result r(s.name);
+    r.add("server", g_config.server).add("server_args", server_args).add("threads", g_config.threads);
+
+    cerr << "[*] " << s.name << " ..." << endl;
+    s.run(targets, r);
+
+    cout << r.str() << endl;
+    out << r.str() << endl;
+
+    if (g_config.check && (r.failed() || r.skipped())) {
+      cerr << "[x] " << s.name << (r.failed() ? " failed" : " was skipped") << endl;
+      status = 1;
+    }
+  }
+
+  return status;
+}
@@ -0,0 +1,340 @@
+//
+// access_log.hpp
+// ~~~~~~~~~~~~~~
+//
+// One record per SOCKS request, written off the I/O threads.
+//
+// Each worker thread appends fixed-size records to its own single producer,
+// single consumer ring. A background thread drains all rings in batches,
+// formats them and writes them out. When a ring is full the record is either
+// dropped and counted, or the worker waits for the writer, as configured.
+// Without the background thread (fork mode) records are written directly.
+//
+
+#ifndef SOCKS_ACCESS_LOG_HPP
+#define SOCKS_ACCESS_LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+
+struct access_record {
+  uint64_t time_us;        // Wall clock, microseconds since the epoch
+  uint8_t src_ip[4];       // Network byte order
+  uint8_t dst_ip[16];      // IPv4 in the first 4 bytes unless dst_v6
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t dst_v6;
+  uint8_t command;         // 1: CONNECT, 2: BIND, 3: UDP ASSOCIATE
+  uint8_t accepted;
+  uint8_t reserved;
+};
+
+class access_log
+{
+public:
+  enum format_t { classic, line, binary };
+  enum policy_t { drop, block };
+  enum { ring_size = 4096 };
+
+  static access_log& instance()
+  {
+    static access_log log;
+    return log;
+  }
+
+  access_log()
+    : out_(stdout),
+      format_(classic),
+      policy_(drop),
+      enabled_(true),
+      running_(false),
+      dropped_(0),
+      written_(0)
+  {
+  }
+
+  ~access_log()
+  {
+    stop();
+  }
+
+  // "-" is stdout, "none" turns logging off
+  bool open(const std::string& path)
+  {
+    if (path == "none") {
+      enabled_ = false;
+      return true;
+    }
+    if (path == "-") {
+      out_ = stdout;
+      return true;
+    }
+    out_ = fopen(path.c_str(), "a");
+    return out_ != NULL;
+  }
+
+  void set_format(format_t format)
+  {
+    format_ = format;
+  }
+
+  void set_policy(policy_t policy)
+  {
+    policy_ = policy;
+  }
+
+  bool enabled() const
+  {
+    return enabled_;
+  }
+
+  // Starts the background writer, call before worker threads log
+  void start()
+  {
+    if (!enabled_ || running_) {
+      return;
+    }
+    running_ = true;
+    writer_ = std::thread([this]() { run(); });
+  }
+
+  // Flushes everything still queued
+  void stop()
+  {
+    if (!running_) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    wakeup_.notify_one();
+    writer_.join();
+    drain();
+    fflush(out_);
+  }
+
+  void log(const access_record& record)
+  {
+    if (!enabled_) {
+      return;
+    }
+
+    if (!running_) {
+      std::string text;
+      format(record, text);
+      write(text);
+      fflush(out_);
+      return;
+    }
+
+    ring& r = local_ring();
+
+    while (!r.push(record)) {
+      if (policy_ == drop || !running_) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      wakeup_.notify_one();
+      std::this_thread::yield();
+    }
+
+    if (r.size() >= ring_size / 2) {
+      wakeup_.notify_one();
+    }
+  }
+
+  uint64_t written() const
+  {
+    return written_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t dropped() const
+  {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  void dump_stats(std::ostream& os)
+  {
+    os << "access_log written=" << written() << " dropped=" << dropped() << "\n";
+  }
+
+private:
+  class ring
+  {
+  public:
+    ring()
+      : head_(0),
+        tail_(0),
+        closed(false)
+    {
+    }
+
+    bool push(const access_record& record)
+    {
+      size_t tail = tail_.load(std::memory_order_relaxed);
+
+      if (tail - head_.load(std::memory_order_acquire) == ring_size) {
+        return false;
+      }
+      records_[tail % ring_size] = record;
+      tail_.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(access_record& record)
+    {
+      size_t head = head_.load(std::memory_order_relaxed);
+
+      if (head == tail_.load(std::memory_order_acquire)) {
+        return false;
+      }
+      record = records_[head % ring_size];
+      head_.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    size_t size() const
+    {
+      return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+    access_record records_[ring_size];
+    std::atomic<bool> closed;  // Owning thread exited
+  };
+
+  // Registers the calling thread's ring on first use
+  ring& local_ring()
+  {
+    struct holder {
+      ~holder()
+      {
+        if (r) {
+          r->closed = true;
+        }
+      }
+      std::shared_ptr<ring> r;
+    };
+    static thread_local holder h;
+
+    if (!h.r) {
+      h.r = std::make_shared<ring>();
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings_.push_back(h.r);
+    }
+    return *h.r;
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (running_) {
+      wakeup_.wait_for(lock, std::chrono::milliseconds(50));
+      lock.unlock();
+      drain();
+      fflush(out_);
+      lock.lock();
+    }
+  }
+
+  // Batches every queued record into one write
+  void drain()
+  {
+    std::vector<std::shared_ptr<ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings = rings_;
+    }
+
+    access_record record;
+    batch_.clear();
+
+    for (std::shared_ptr<ring>& r : rings) {
+      while (r->pop(record)) {
+        format(record, batch_);
+        written_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    if (!batch_.empty()) {
+      write(batch_);
+    }
+
+    // Forget rings of exited threads once they're empty
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < rings_.size(); ) {
+      if (rings_[i]->closed && rings_[i]->size() == 0) {
+        rings_[i] = rings_.back();
+        rings_.pop_back();
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  void write(const std::string& text)
+  {
+    fwrite(text.data(), 1, text.size(), out_);
+  }
+
+  void format(const access_record& r, std::string& out)
+  {
+    char src[INET_ADDRSTRLEN];
+    char dst[INET6_ADDRSTRLEN];
+    char buf[256];
+    const char *command = r.command == 1 ? "CONNECT" : (r.command == 2 ? "BIND" : (r.command == 3 ? "UDP" : ""));
+    const char *reply = r.accepted ? "Accept" : "Reject";
+
+    if (format_ == binary) {
+      out.append((const char *)&r, sizeof(r));
+      return;
+    }
+
+    inet_ntop(AF_INET, r.src_ip, src, sizeof(src));
+    inet_ntop(r.dst_v6 ? AF_INET6 : AF_INET, r.dst_ip, dst, sizeof(dst));
+
+    if (format_ == classic) {
+      snprintf(buf, sizeof(buf),
+               "<S_IP>: %s\n<S_PORT>: %u\n<D_IP>: %s\n<D_PORT>: %u\n%s%s%s<Reply>: %s\n",
+               src, r.src_port, dst, r.dst_port,
+               *command ? "<Command>: " : "", command, *command ? "\n" : "",
+               reply);
+    } else {
+      snprintf(buf, sizeof(buf), "%llu.%06llu %s:%u %s:%u %s %s\n",
+               (unsigned long long)(r.time_us / 1000000),
+               (unsigned long long)(r.time_us % 1000000),
+               src, r.src_port, dst, r.dst_port,
+               *command ? command : "-", reply);
+    }
+    out.append(buf);
+  }
+
+  FILE *out_;
+  format_t format_;
+  policy_t policy_;
+  bool enabled_;
+  std::atomic<bool> running_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> written_;
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::vector<std::shared_ptr<ring>> rings_;
+  std::thread writer_;
+  std::string batch_;
+};
+
+#endif // SOCKS_ACCESS_LOG_HPP
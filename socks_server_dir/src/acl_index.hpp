@@ -0,0 +1,212 @@
+//
+// acl_index.hpp
+// ~~~~~~~~~~~~~
+//
+// Destination index over firewall rules.
+//
+// Rules whose destination is a prefix (CIDR, or wildcards in the trailing
+// octets) hang off a path-compressed binary trie. A lookup walks from the
+// root along the destination address, through at most 33 nodes, and only
+// looks at the rules on that path, so the cost depends on how many prefixes
+// cover the address and not on the size of the rule set. Masks with holes,
+// such as *.1.*.*, can't be placed in the trie and are always tried.
+//
+// Rule ids grow in file order, so every list is sorted and the first match
+// in a list is the only candidate it has. The smallest matching id wins,
+// which keeps the first-match semantics of the file. The lists are chained
+// through one flat array rather than a vector per node, a table of 100k
+// rules is a handful of allocations and a forked child that exits doesn't
+// walk and free all of them.
+//
+
+#ifndef SOCKS_ACL_INDEX_HPP
+#define SOCKS_ACL_INDEX_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class acl_index
+{
+public:
+  static const uint32_t none = 0xffffffff;
+
+  acl_index()
+    : others_first_(-1),
+      others_last_(-1)
+  {
+    nodes_.push_back(node(0, 0));
+  }
+
+  // Ids have to be added in increasing order
+  void add(uint32_t addr, uint32_t mask, uint32_t id)
+  {
+    int length = prefix_length(mask);
+
+    if (length < 0) {
+      append(others_first_, others_last_, id);
+    } else {
+      insert(addr & mask, length, id);
+    }
+  }
+
+  // The smallest id on addr's path for which match(id) holds, none when
+  // there is no such rule
+  template <typename Match>
+  uint32_t find(uint32_t addr, Match match) const
+  {
+    uint32_t best = none;
+    int32_t n = 0;
+
+    while (n != -1) {
+      const node& cur = nodes_[n];
+
+      if ((addr & mask_of(cur.length)) != cur.prefix) {
+        break;
+      }
+      first_match(cur.first, match, best);
+      if (cur.length == 32) {
+        break;
+      }
+      n = cur.child[bit(addr, cur.length)];
+    }
+
+    first_match(others_first_, match, best);
+    return best;
+  }
+
+  size_t nodes() const
+  {
+    return nodes_.size();
+  }
+
+private:
+  struct node {
+    node(uint32_t p, int l)
+      : prefix(p),
+        length(l),
+        first(-1),
+        last(-1)
+    {
+      child[0] = child[1] = -1;
+    }
+
+    uint32_t prefix;  // Host byte order, masked to length
+    int length;
+    int32_t child[2];
+    int32_t first;    // Rules ending here, into entries_
+    int32_t last;
+  };
+
+  struct entry {
+    uint32_t id;
+    int32_t next;
+  };
+
+  // -1 unless the mask is contiguous from the top
+  static int prefix_length(uint32_t mask)
+  {
+    uint32_t host = ~mask;
+
+    if ((host & (host + 1)) != 0) {
+      return -1;
+    }
+    return __builtin_popcount(mask);
+  }
+
+  static uint32_t mask_of(int length)
+  {
+    return length == 0 ? 0 : ~(uint32_t)0 << (32 - length);
+  }
+
+  // Bit i counted from the most significant one
+  static int bit(uint32_t addr, int i)
+  {
+    return (addr >> (31 - i)) & 1;
+  }
+
+  template <typename Match>
+  void first_match(int32_t e, Match& match, uint32_t& best) const
+  {
+    for (; e != -1; e = entries_[e].next) {
+      uint32_t id = entries_[e].id;
+
+      if (id >= best) {
+        return;
+      }
+      if (match(id)) {
+        best = id;
+        return;
+      }
+    }
+  }
+
+  void append(int32_t& first, int32_t& last, uint32_t id)
+  {
+    entry e = { id, -1 };
+
+    entries_.push_back(e);
+    if (last == -1) {
+      first = entries_.size() - 1;
+    } else {
+      entries_[last].next = entries_.size() - 1;
+    }
+    last = entries_.size() - 1;
+  }
+
+  int32_t add_node(uint32_t prefix, int length)
+  {
+    nodes_.push_back(node(prefix, length));
+    return nodes_.size() - 1;
+  }
+
+  // Every node's prefix is a prefix of the ones below it. An edge that
+  // diverges from the new prefix early is split by a node at the point
+  // where they part.
+  void insert(uint32_t prefix, int length, uint32_t id)
+  {
+    int32_t n = 0;
+
+    while (nodes_[n].length != length) {
+      int b = bit(prefix, nodes_[n].length);
+      int32_t c = nodes_[n].child[b];
+
+      if (c == -1) {
+        c = add_node(prefix, length);
+        nodes_[n].child[b] = c;
+        n = c;
+        break;
+      }
+
+      uint32_t diff = nodes_[c].prefix ^ prefix;
+      int common = diff ? __builtin_clz(diff) : 32;
+      common = std::min(common, std::min(nodes_[c].length, length));
+
+      if (common == nodes_[c].length) {
+        n = c;
+        continue;
+      }
+
+      int32_t split = add_node(prefix & mask_of(common), common);
+      nodes_[split].child[bit(nodes_[c].prefix, common)] = c;
+      nodes_[n].child[b] = split;
+      n = split;
+      if (common != length) {
+        int32_t leaf = add_node(prefix, length);
+        nodes_[split].child[bit(prefix, common)] = leaf;
+        n = leaf;
+      }
+      break;
+    }
+
+    append(nodes_[n].first, nodes_[n].last, id);
+  }
+
+  std::vector<node> nodes_;
+  std::vector<entry> entries_;
+  int32_t others_first_;  // Masks with holes
+  int32_t others_last_;
+};
+
+#endif // SOCKS_ACL_INDEX_HPP
@@ -0,0 +1,178 @@
+//
+// admission.hpp
+// ~~~~~~~~~~~~~
+//
+// Admission control for the accept loops.
+//
+// The session limit has hysteresis: a loop stops accepting at the limit and
+// starts again once a tenth of the slots are free, new connections wait in
+// the listen backlog meanwhile. When the process runs out of descriptors a
+// spare one is given up for a moment to take the oldest pending connection
+// and close it, instead of leaving it queued and retrying the failing accept
+// in a tight loop.
+//
+
+#ifndef SOCKS_ADMISSION_HPP
+#define SOCKS_ADMISSION_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class admission
+{
+public:
+  // Connections taken per wakeup, and how long a loop waits after a
+  // resource error or before looking at the limit again
+  enum { batch = 16, backoff_ms = 100, recheck_ms = 10 };
+
+  static admission& instance()
+  {
+    static admission a;
+    return a;
+  }
+
+  // 0 means unlimited
+  void set_max_sessions(size_t n)
+  {
+    max_ = n;
+    resume_at_ = n - n / 10;
+  }
+
+  size_t max_sessions() const
+  {
+    return max_;
+  }
+
+  // Keeps one descriptor in reserve for shed()
+  void reserve()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (spare_ == -1) {
+      spare_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+  }
+
+  // Whether a loop with `active` sessions open may accept, paused is the
+  // loop's own state
+  bool admit(size_t active, bool& paused)
+  {
+    if (max_ == 0) {
+      return true;
+    }
+    if (paused) {
+      paused = active > resume_at_;
+    } else if (active >= max_) {
+      paused = true;
+      paused_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return !paused;
+  }
+
+  // accept() failed for lack of descriptors: closes the oldest pending
+  // connection on listen_fd using the spare
+  void shed(int listen_fd)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (spare_ != -1) {
+      ::close(spare_);
+      spare_ = -1;
+    }
+
+    int fd = ::accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd != -1) {
+      ::close(fd);
+      shed_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    spare_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  // Errors worth a backoff, everything else concerns one connection only
+  static bool out_of_descriptors(int err)
+  {
+    return err == EMFILE || err == ENFILE;
+  }
+
+  static bool out_of_resources(int err)
+  {
+    return out_of_descriptors(err) || err == ENOBUFS || err == ENOMEM;
+  }
+
+  // Counts the error, returns how long the loop should wait before the next
+  // accept, 0 for right away
+  int failed(int err, int listen_fd)
+  {
+    errors_.fetch_add(1, std::memory_order_relaxed);
+
+    if (out_of_descriptors(err)) {
+      shed(listen_fd);
+    }
+    return out_of_resources(err) ? backoff_ms : 0;
+  }
+
+  // An accept loop found connections queued, accepted / wakeups is the
+  // average batch
+  void woke()
+  {
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t wakeup_count() const
+  {
+    return wakeups_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t shed_count() const
+  {
+    return shed_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t paused_count() const
+  {
+    return paused_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t error_count() const
+  {
+    return errors_.load(std::memory_order_relaxed);
+  }
+
+  void dump_stats(std::ostream& os)
+  {
+    os << "admission max_sessions=" << max_ << " wakeups=" << wakeup_count()
+       << " paused=" << paused_count()
+       << " shed=" << shed_count() << " accept_errors=" << error_count() << "\n";
+  }
+
+private:
+  admission()
+    : max_(0),
+      resume_at_(0),
+      spare_(-1),
+      wakeups_(0),
+      shed_(0),
+      paused_(0),
+      errors_(0)
+  {
+  }
+
+  size_t max_;
+  size_t resume_at_;
+  std::mutex mutex_;
+  int spare_;
+  std::atomic<uint64_t> wakeups_;
+  std::atomic<uint64_t> shed_;
+  std::atomic<uint64_t> paused_;
+  std::atomic<uint64_t> errors_;
+};
+
+#endif // SOCKS_ADMISSION_HPP
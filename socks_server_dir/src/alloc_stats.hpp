@@ -0,0 +1,106 @@
+//
+// alloc_stats.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Counts calls to the global operator new.
+//
+// socks_server replaces operator new and reports every call here, so a
+// scrape shows whether some path allocates per request or per relayed
+// chunk. A relay in steady state is expected to keep the counter flat.
+// Like the session metrics, every thread counts in a slot of its own and
+// the slots are summed when read; threads past the last slot share one with
+// atomic adds. Counts are per process, forked children keep their own.
+//
+
+#ifndef SOCKS_ALLOC_STATS_HPP
+#define SOCKS_ALLOC_STATS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+class alloc_stats
+{
+public:
+  enum { slots = 256 };
+
+  // Called from operator new, must not allocate
+  static void allocated(std::size_t size)
+  {
+    static thread_local slot *mine = NULL;
+
+    if (!mine) {
+      size_t i = next().fetch_add(1, std::memory_order_relaxed);
+      mine = i < slots ? &table()[i] : NULL;
+      if (!mine) {
+        shared().count.fetch_add(1, std::memory_order_relaxed);
+        shared().bytes.fetch_add(size, std::memory_order_relaxed);
+        return;
+      }
+    }
+    // Only the owning thread writes, so a relaxed load/store pair is enough
+    mine->count.store(mine->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    mine->bytes.store(mine->bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+  }
+
+  static uint64_t allocation_count()
+  {
+    uint64_t n = shared().count.load(std::memory_order_relaxed);
+
+    for (size_t i = 0; i < used(); ++i) {
+      n += table()[i].count.load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  static uint64_t allocated_bytes()
+  {
+    uint64_t n = shared().bytes.load(std::memory_order_relaxed);
+
+    for (size_t i = 0; i < used(); ++i) {
+      n += table()[i].bytes.load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  static void dump_stats(std::ostream& os)
+  {
+    os << "heap allocations=" << allocation_count() << " bytes=" << allocated_bytes() << "\n";
+  }
+
+private:
+  // A cache line each, threads don't write to each other's lines
+  struct alignas(64) slot {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+  };
+
+  // Zero initialized before any constructor runs, usable from the first
+  // operator new on
+  static slot *table()
+  {
+    static slot s[slots];
+    return s;
+  }
+
+  static slot& shared()
+  {
+    static slot s;
+    return s;
+  }
+
+  static std::atomic<size_t>& next()
+  {
+    static std::atomic<size_t> n(0);
+    return n;
+  }
+
+  static size_t used()
+  {
+    size_t n = next().load(std::memory_order_relaxed);
+    return n < slots ? n : slots;
+  }
+};
+
+#endif // SOCKS_ALLOC_STATS_HPP
@@ -0,0 +1,205 @@
+//
+// buffer_pool.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Per-thread pool of relay buffers.
+//
+// Buffers come in power of two size classes from 4 KiB to 128 MiB. Released
+// buffers are cached for reuse up to a per-thread byte limit, anything past
+// that goes back to the allocator. Every pool registers its counters so the
+// totals can be reported from any thread.
+//
+
+#ifndef SOCKS_BUFFER_POOL_HPP
+#define SOCKS_BUFFER_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+class buffer_pool
+{
+public:
+  enum { min_size = 0x1000, classes = 16, max_size = min_size << (classes - 1) };
+
+  struct stats {
+    std::atomic<uint64_t> hits;      // Served from the cache
+    std::atomic<uint64_t> misses;    // Had to allocate
+    std::atomic<uint64_t> releases;  // Kept for reuse
+    std::atomic<uint64_t> frees;     // Cache full, given back
+    std::atomic<uint64_t> cached;    // Bytes sitting in the cache
+  };
+
+  buffer_pool()
+    : cached_bytes_(0)
+  {
+    stats_.hits = 0;
+    stats_.misses = 0;
+    stats_.releases = 0;
+    stats_.frees = 0;
+    stats_.cached = 0;
+
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().push_back(this);
+  }
+
+  ~buffer_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      std::vector<buffer_pool *>& pools = registry();
+      for (size_t i = 0; i < pools.size(); ++i) {
+        if (pools[i] == this) {
+          pools[i] = pools.back();
+          pools.pop_back();
+          break;
+        }
+      }
+      stats_.cached = 0;
+      retired() += stats_;
+    }
+
+    for (std::vector<char *>& list : free_) {
+      for (char *p : list) {
+        delete[] p;
+      }
+    }
+  }
+
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  // The pool of the calling thread
+  static buffer_pool& local()
+  {
+    static thread_local buffer_pool pool;
+    return pool;
+  }
+
+  // Returns a buffer of at least size bytes, but never more than max_size.
+  // capacity is set to its real size, which is what callers may fill.
+  char *acquire(size_t size, size_t& capacity)
+  {
+    int cls = size_class(size);
+    std::vector<char *>& list = free_[cls];
+
+    capacity = (size_t)min_size << cls;
+
+    if (!list.empty()) {
+      char *p = list.back();
+      list.pop_back();
+      cached_bytes_ -= capacity;
+      bump(stats_.hits);
+      stats_.cached.store(cached_bytes_, std::memory_order_relaxed);
+      return p;
+    }
+
+    bump(stats_.misses);
+    return new char[capacity];
+  }
+
+  void release(char *p, size_t capacity)
+  {
+    if (cached_bytes_ + capacity > cache_limit()) {
+      bump(stats_.frees);
+      delete[] p;
+      return;
+    }
+
+    free_[size_class(capacity)].push_back(p);
+    cached_bytes_ += capacity;
+    bump(stats_.releases);
+    stats_.cached.store(cached_bytes_, std::memory_order_relaxed);
+  }
+
+  // Upper bound of bytes each thread keeps cached
+  static size_t& cache_limit()
+  {
+    static size_t limit = (size_t)8 << 20;
+    return limit;
+  }
+
+  static void dump_stats(std::ostream& os)
+  {
+    totals t = total();
+
+    os << "buffer_pool hits=" << t.hits
+       << " misses=" << t.misses
+       << " releases=" << t.releases
+       << " frees=" << t.frees
+       << " cached_bytes=" << t.cached << "\n";
+  }
+
+  struct totals {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t releases = 0;
+    uint64_t frees = 0;
+    uint64_t cached = 0;
+
+    totals& operator+=(const stats& s)
+    {
+      hits += s.hits.load(std::memory_order_relaxed);
+      misses += s.misses.load(std::memory_order_relaxed);
+      releases += s.releases.load(std::memory_order_relaxed);
+      frees += s.frees.load(std::memory_order_relaxed);
+      cached += s.cached.load(std::memory_order_relaxed);
+      return *this;
+    }
+  };
+
+  // Counters summed over live pools and pools of threads that exited
+  static totals total()
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    totals t = retired();
+
+    for (buffer_pool *pool : registry()) {
+      t += pool->stats_;
+    }
+    return t;
+  }
+
+private:
+  static int size_class(size_t size)
+  {
+    int cls = 0;
+    while (((size_t)min_size << cls) < size && cls < classes - 1) {
+      ++cls;
+    }
+    return cls;
+  }
+
+  // Only the owning thread writes, so a relaxed load/store pair is enough
+  static void bump(std::atomic<uint64_t>& counter)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  static std::vector<buffer_pool *>& registry()
+  {
+    static std::vector<buffer_pool *> pools;
+    return pools;
+  }
+
+  static std::mutex& registry_mutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static totals& retired()
+  {
+    static totals t;
+    return t;
+  }
+
+  std::vector<char *> free_[classes];
+  size_t cached_bytes_;
+  stats stats_;
+};
+
+#endif // SOCKS_BUFFER_POOL_HPP
@@ -0,0 +1,84 @@
+//
+// decision_cache.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Direct-mapped cache of firewall decisions per (command, IPv4 address).
+//
+// Every slot is one 64-bit atomic holding the key and the verdict, so a
+// lookup is a single relaxed load and threads never lock or wait on each
+// other. Two keys hashing to the same slot just take turns, a racing store
+// can only replace one correct decision with another. The cache belongs to
+// a rule snapshot and goes away with it, a reload starts out empty.
+//
+
+#ifndef SOCKS_DECISION_CACHE_HPP
+#define SOCKS_DECISION_CACHE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class decision_cache
+{
+public:
+  enum { default_bits = 14 };
+
+  explicit decision_cache(int bits = default_bits)
+    : bits_(bits),
+      slots_(new std::atomic<uint64_t>[(size_t)1 << bits])
+  {
+    for (size_t i = 0; i < size(); ++i) {
+      slots_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  decision_cache(const decision_cache&) = delete;
+  decision_cache& operator=(const decision_cache&) = delete;
+
+  // True on a hit, permit is the cached verdict then
+  bool find(uint8_t command, uint32_t addr, bool& permit) const
+  {
+    uint64_t key = make_key(command, addr);
+    uint64_t slot = slots_[index(key)].load(std::memory_order_relaxed);
+
+    if ((slot & ~permit_bit) != key) {
+      return false;
+    }
+    permit = (slot & permit_bit) != 0;
+    return true;
+  }
+
+  void store(uint8_t command, uint32_t addr, bool permit) const
+  {
+    uint64_t key = make_key(command, addr);
+
+    slots_[index(key)].store(key | ((uint64_t)permit << permit_shift), std::memory_order_relaxed);
+  }
+
+  size_t size() const
+  {
+    return (size_t)1 << bits_;
+  }
+
+private:
+  enum { valid_shift = 63, permit_shift = 62 };
+  static const uint64_t valid_bit = (uint64_t)1 << valid_shift;
+  static const uint64_t permit_bit = (uint64_t)1 << permit_shift;
+
+  static uint64_t make_key(uint8_t command, uint32_t addr)
+  {
+    return valid_bit | ((uint64_t)command << 32) | addr;
+  }
+
+  // Fibonacci hashing, neighbouring addresses spread over the table
+  size_t index(uint64_t key) const
+  {
+    return (size_t)(((key & 0xffffffffffULL) * 0x9e3779b97f4a7c15ULL) >> (64 - bits_));
+  }
+
+  int bits_;
+  std::unique_ptr<std::atomic<uint64_t>[]> slots_;
+};
+
+#endif // SOCKS_DECISION_CACHE_HPP
@@ -0,0 +1,251 @@
+//
+// dns_cache.hpp
+// ~~~~~~~~~~~~~
+//
+// Shared cache of hostname lookups for SOCKS4A requests.
+//
+// Answers are kept for the configured TTL, or for the TTL of their records
+// when the thread's dns_client found them and that is shorter (getaddrinfo
+// doesn't report one). Failed lookups are kept for a shorter negative TTL.
+// While a name is being resolved, other requests for it wait on the same
+// lookup instead of starting their own.
+// The table is split into shards so worker threads rarely share a lock.
+// Misses go to getaddrinfo, or to the thread's dns_client when DNS servers
+// are configured.
+//
+
+#ifndef SOCKS_DNS_CACHE_HPP
+#define SOCKS_DNS_CACHE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "dns_client.hpp"
+
+class dns_cache
+{
+public:
+  typedef std::vector<boost::asio::ip::address> addresses;
+  typedef std::function<void(const boost::system::error_code&, const addresses&)> handler;
+  typedef std::chrono::steady_clock clock;
+
+  enum { shards = 16, shard_entries = 4096 };
+
+  struct totals {
+    uint64_t hits = 0;
+    uint64_t negative_hits = 0;
+    uint64_t misses = 0;
+    uint64_t coalesced = 0;
+    uint64_t entries = 0;
+  };
+
+  static dns_cache& instance()
+  {
+    static dns_cache cache;
+    return cache;
+  }
+
+  // Most seconds an answer is kept, 0 disables caching (lookups still
+  // coalesce)
+  std::chrono::seconds ttl = std::chrono::seconds(60);
+  std::chrono::seconds negative_ttl = std::chrono::seconds(5);
+
+  // The handler always runs on io_context
+  void resolve(const std::string& host, boost::asio::io_context& io_context, handler h)
+  {
+    shard& s = shard_for(host);
+    clock::time_point now = clock::now();
+
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      entry& e = s.entries[host];
+
+      if (e.resolving) {
+        ++s.stats.coalesced;
+        e.waiters.push_back(waiter(&io_context, std::move(h)));
+        return;
+      }
+
+      if (e.expiry > now) {
+        boost::system::error_code ec = e.ec;
+        addresses result = e.result;
+
+        if (ec) {
+          ++s.stats.negative_hits;
+        } else {
+          ++s.stats.hits;
+        }
+        boost::asio::post(io_context, [h, ec, result]() { h(ec, result); });
+        return;
+      }
+
+      ++s.stats.misses;
+      e.resolving = true;
+      e.waiters.push_back(waiter(&io_context, std::move(h)));
+
+      if (s.entries.size() > shard_entries) {
+        evict(s, now);
+      }
+    }
+
+    // Lookup runs on the requesting thread's context
+    if (dns_client::enabled()) {
+      dns_client::local(io_context).resolve(host,
+        [this, host](const boost::system::error_code& ec, const addresses& result, std::chrono::seconds ttl)
+        {
+          complete(host, ec, result, ttl);
+        });
+      return;
+    }
+
+    std::shared_ptr<boost::asio::ip::tcp::resolver> resolver =
+      std::make_shared<boost::asio::ip::tcp::resolver>(io_context);
+
+    resolver->async_resolve(host, "0",
+      [this, resolver, host](boost::system::error_code ec,
+                             boost::asio::ip::tcp::resolver::results_type endpoints)
+      {
+        addresses result;
+
+        if (!ec) {
+          for (auto it = endpoints.cbegin(); it != endpoints.cend(); ++it) {
+            result.push_back(it->endpoint().address());
+          }
+          if (result.empty()) {
+            ec = boost::asio::error::host_not_found;
+          }
+        }
+
+        // No TTL from getaddrinfo, the configured one applies
+        complete(host, ec, result, std::chrono::seconds::max());
+      });
+  }
+
+  totals total()
+  {
+    totals t;
+
+    for (shard& s : shards_) {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      t.hits += s.stats.hits;
+      t.negative_hits += s.stats.negative_hits;
+      t.misses += s.stats.misses;
+      t.coalesced += s.stats.coalesced;
+      t.entries += s.entries.size();
+    }
+    return t;
+  }
+
+  void dump_stats(std::ostream& os)
+  {
+    totals t = total();
+
+    os << "dns_cache hits=" << t.hits
+       << " negative_hits=" << t.negative_hits
+       << " misses=" << t.misses
+       << " coalesced=" << t.coalesced
+       << " entries=" << t.entries << "\n";
+  }
+
+private:
+  typedef std::pair<boost::asio::io_context *, handler> waiter;
+
+  struct entry {
+    bool resolving = false;
+    clock::time_point expiry;
+    boost::system::error_code ec;
+    addresses result;
+    std::vector<waiter> waiters;
+  };
+
+  struct shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, entry> entries;
+    totals stats;
+  };
+
+  // A record TTL only ever shortens the configured one
+  void complete(const std::string& host, const boost::system::error_code& ec, const addresses& result,
+                std::chrono::seconds record_ttl)
+  {
+    shard& s = shard_for(host);
+    std::vector<waiter> waiters;
+
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      entry& e = s.entries[host];
+
+      e.resolving = false;
+      e.ec = ec;
+      e.result = result;
+      e.expiry = clock::now() + (ec ? negative_ttl : std::min(ttl, record_ttl));
+      waiters.swap(e.waiters);
+    }
+
+    for (waiter& w : waiters) {
+      handler h = std::move(w.second);
+      boost::asio::post(*w.first, [h, ec, result]() { h(ec, result); });
+    }
+  }
+
+  // Drop expired names. If the shard is still full, drop the idle names that
+  // expire soonest, down to 7/8 of a shard so the next misses don't scan
+  // again.
+  static void evict(shard& s, clock::time_point now)
+  {
+    for (auto it = s.entries.begin(); it != s.entries.end(); ) {
+      if (!it->second.resolving && it->second.expiry <= now) {
+        it = s.entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (s.entries.size() <= shard_entries) {
+      return;
+    }
+
+    std::vector<clock::time_point> expiries;
+
+    for (auto& kv : s.entries) {
+      if (!kv.second.resolving) {
+        expiries.push_back(kv.second.expiry);
+      }
+    }
+
+    if (expiries.empty()) {
+      return;
+    }
+
+    size_t excess = std::min(s.entries.size() - shard_entries / 8 * 7, expiries.size());
+
+    std::nth_element(expiries.begin(), expiries.begin() + (excess - 1), expiries.end());
+
+    clock::time_point cutoff = expiries[excess - 1];
+
+    for (auto it = s.entries.begin(); it != s.entries.end() && excess > 0; ) {
+      if (!it->second.resolving && it->second.expiry <= cutoff) {
+        it = s.entries.erase(it);
+        --excess;
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  shard& shard_for(const std::string& host)
+  {
+    return shards_[std::hash<std::string>()(host) % shards];
+  }
+
+  shard shards_[shards];
+};
+
+#endif // SOCKS_DNS_CACHE_HPP
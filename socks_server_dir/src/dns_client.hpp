@@ -0,0 +1,491 @@
+//
+// dns_client.hpp
+// ~~~~~~~~~~~~~~
+//
+// Non-blocking DNS client that runs on the worker's own io_context.
+//
+// getaddrinfo blocks, so asio runs it on a private resolver thread and
+// lookups queue up behind each other. This client sends A queries over UDP
+// instead and any number of them can be in flight. Each thread has a few
+// sockets per configured server, connected so the kernel drops datagrams
+// from anyone else; queries on a socket are told apart by a random ID, and
+// an answer only counts if its ID and question match a pending query. IDs
+// come from a generator seeded from std::random_device per thread and
+// reseeded every few thousand queries, so they can't be predicted from the
+// ones seen on the wire.
+// Timeouts ride on the thread's timer wheel, so they are good to a tick. A
+// query that times out or gets SERVFAIL/REFUSED is sent again to the next
+// server, with a fresh ID.
+//
+// Only the configured servers are asked, /etc/hosts is not read. Answers
+// come with the smallest TTL of their records; caching and coalescing of
+// equal names are left to dns_cache.
+//
+
+#ifndef SOCKS_DNS_CLIENT_HPP
+#define SOCKS_DNS_CLIENT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "timer_wheel.hpp"
+
+class dns_client
+{
+public:
+  typedef boost::asio::ip::udp udp;
+  typedef std::vector<boost::asio::ip::address> addresses;
+  // The TTL is only meaningful with addresses, address literals never expire
+  typedef std::function<void(const boost::system::error_code&, const addresses&, std::chrono::seconds)> handler;
+
+  enum { sockets_per_server = 2, max_packet = 1232, max_pending = 0x8000 };
+  enum { reseed_interval = 4096 };
+
+  // Set up before any worker runs, read-only afterwards
+  struct config {
+    std::vector<udp::endpoint> servers;
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(1000);
+    int attempts = 3;
+  };
+
+  static config& options()
+  {
+    static config c;
+    return c;
+  }
+
+  // Without servers names go to getaddrinfo
+  static bool enabled()
+  {
+    return !options().servers.empty();
+  }
+
+  // The calling thread's client, driven by the io_context it runs. Never
+  // freed, like the thread's timer wheel.
+  static dns_client& local(boost::asio::io_context& io_context)
+  {
+    static thread_local dns_client *client = NULL;
+
+    if (!client) {
+      client = new dns_client(io_context);
+    }
+    return *client;
+  }
+
+  explicit dns_client(boost::asio::io_context& io_context)
+    : io_context_(io_context),
+      wheel_(timer_wheel::local(io_context)),
+      next_socket_(0),
+      random_(seeded()),
+      ids_left_(reseed_interval)
+  {
+    for (const udp::endpoint& server : options().servers) {
+      for (int i = 0; i < sockets_per_server; ++i) {
+        channels_.emplace_back(new channel(io_context, server));
+      }
+    }
+  }
+
+  // The handler runs on this client's io_context, never from within resolve()
+  void resolve(const std::string& host, handler h)
+  {
+    boost::system::error_code ec;
+    boost::asio::ip::address literal = boost::asio::ip::make_address(host, ec);
+    std::unique_ptr<query> q;
+
+    if (!ec) {
+      addresses result(1, literal);
+      boost::asio::post(io_context_, [h, result]()
+        {
+          h(boost::system::error_code(), result, std::chrono::seconds::max());
+        });
+      return;
+    }
+    q.reset(new query(*this));
+    if (!encode(host, q->packet)) {
+      boost::asio::post(io_context_, [h]()
+        {
+          h(boost::asio::error::host_not_found, addresses(), std::chrono::seconds(0));
+        });
+      return;
+    }
+
+    q->done = std::move(h);
+    q->attempt = 0;
+    q->channel = pick_channel(0);
+    send(std::move(q));
+  }
+
+  static uint64_t query_count()
+  {
+    return queries().load(std::memory_order_relaxed);
+  }
+
+  static uint64_t retry_count()
+  {
+    return retries().load(std::memory_order_relaxed);
+  }
+
+  static uint64_t timeout_count()
+  {
+    return timeouts().load(std::memory_order_relaxed);
+  }
+
+  static void dump_stats(std::ostream& os)
+  {
+    os << "dns_client servers=" << options().servers.size() << " queries=" << query_count()
+       << " retries=" << retry_count() << " timeouts=" << timeout_count() << "\n";
+  }
+
+private:
+  struct query
+    : timer_wheel::entry
+  {
+    explicit query(dns_client& c)
+      : owner(c),
+        channel(0),
+        id(0),
+        attempt(0)
+    {
+    }
+
+    void expired() override
+    {
+      owner.on_timeout(*this);
+    }
+
+    dns_client& owner;
+    std::string packet;  // Header and question, the ID is filled in per send
+    handler done;
+    size_t channel;
+    uint16_t id;
+    int attempt;
+  };
+
+  struct channel {
+    channel(boost::asio::io_context& io_context, const udp::endpoint& s)
+      : socket(io_context),
+        server(s),
+        receiving(false)
+    {
+    }
+
+    udp::socket socket;
+    udp::endpoint server;
+    bool receiving;
+    std::unordered_map<uint16_t, std::unique_ptr<query>> pending;
+    char buffer[max_packet];
+  };
+
+  enum { header_size = 12, type_a = 1, type_cname = 5, class_in = 1 };
+  enum { rcode_ok = 0, rcode_nxdomain = 3 };
+
+  static std::atomic<uint64_t>& queries()
+  {
+    static std::atomic<uint64_t> n(0);
+    return n;
+  }
+
+  static std::atomic<uint64_t>& retries()
+  {
+    static std::atomic<uint64_t> n(0);
+    return n;
+  }
+
+  static std::atomic<uint64_t>& timeouts()
+  {
+    static std::atomic<uint64_t> n(0);
+    return n;
+  }
+
+  // 256 bits from random_device rather than the 32 a plain seed takes
+  static std::mt19937 seeded()
+  {
+    std::random_device device;
+    std::seed_seq seed{ device(), device(), device(), device(), device(), device(), device(), device() };
+
+    return std::mt19937(seed);
+  }
+
+  uint16_t next_id()
+  {
+    if (--ids_left_ == 0) {
+      random_ = seeded();
+      ids_left_ = reseed_interval;
+    }
+    return (uint16_t)random_();
+  }
+
+  // Header with RD set and one IN A question; false for names that can't
+  // go on the wire
+  static bool encode(std::string host, std::string& packet)
+  {
+    static const char header[header_size] = { 0, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+
+    if (!host.empty() && host[host.size() - 1] == '.') {
+      host.erase(host.size() - 1);
+    }
+    if (host.empty() || host.size() > 253) {
+      return false;
+    }
+
+    packet.assign(header, sizeof(header));
+    for (size_t start = 0; start <= host.size(); ) {
+      size_t dot = host.find('.', start);
+      size_t length = (dot == std::string::npos ? host.size() : dot) - start;
+
+      if (length == 0 || length > 63) {
+        return false;
+      }
+      packet += (char)length;
+      packet.append(host, start, length);
+      start += length + 1;
+    }
+    packet += '\0';
+    packet += '\0';
+    packet += (char)type_a;
+    packet += '\0';
+    packet += (char)class_in;
+    return true;
+  }
+
+  // Attempts go round the servers starting with the first, sockets of a
+  // server take turns
+  size_t pick_channel(int attempt)
+  {
+    size_t server = attempt % options().servers.size();
+
+    return server * sockets_per_server + (next_socket_++ % sockets_per_server);
+  }
+
+  bool open(channel& c, boost::system::error_code& ec)
+  {
+    c.socket.open(c.server.protocol(), ec);
+    if (!ec) {
+      c.socket.connect(c.server, ec);
+    }
+    if (!ec) {
+      c.socket.non_blocking(true, ec);
+    }
+    if (ec) {
+      boost::system::error_code ignored;
+      c.socket.close(ignored);
+      return false;
+    }
+    return true;
+  }
+
+  void send(std::unique_ptr<query> q)
+  {
+    channel& c = *channels_[q->channel];
+    boost::system::error_code ec;
+
+    if (!c.socket.is_open() && !open(c, ec)) {
+      finish(std::move(q), ec, addresses(), std::chrono::seconds(0));
+      return;
+    }
+    if (c.pending.size() >= max_pending) {
+      finish(std::move(q), boost::asio::error::no_buffer_space, addresses(), std::chrono::seconds(0));
+      return;
+    }
+
+    do {
+      q->id = next_id();
+    } while (c.pending.count(q->id));
+    q->packet[0] = (char)(q->id >> 8);
+    q->packet[1] = (char)q->id;
+
+    // A datagram that doesn't go out is just another lost one, the timeout
+    // takes care of it
+    c.socket.send(boost::asio::buffer(q->packet), 0, ec);
+    queries().fetch_add(1, std::memory_order_relaxed);
+
+    wheel_.schedule(*q, options().timeout);
+    c.pending[q->id] = std::move(q);
+    if (!c.receiving) {
+      receive(c);
+    }
+  }
+
+  // Takes the query off its socket, the ID may be used again from here on
+  std::unique_ptr<query> take(channel& c, uint16_t id)
+  {
+    std::unique_ptr<query> q;
+    auto it = c.pending.find(id);
+
+    if (it != c.pending.end()) {
+      q = std::move(it->second);
+      c.pending.erase(it);
+      q->cancel();
+    }
+    if (c.pending.empty() && c.receiving) {
+      boost::system::error_code ignored;
+      c.socket.cancel(ignored);
+    }
+    return q;
+  }
+
+  void retry(std::unique_ptr<query> q, const boost::system::error_code& ec)
+  {
+    if (++q->attempt >= options().attempts) {
+      if (ec == boost::asio::error::timed_out) {
+        timeouts().fetch_add(1, std::memory_order_relaxed);
+      }
+      finish(std::move(q), ec, addresses(), std::chrono::seconds(0));
+      return;
+    }
+    retries().fetch_add(1, std::memory_order_relaxed);
+    q->channel = pick_channel(q->attempt);
+    send(std::move(q));
+  }
+
+  void finish(std::unique_ptr<query> q, const boost::system::error_code& ec, const addresses& result,
+              std::chrono::seconds ttl)
+  {
+    handler h = std::move(q->done);
+
+    q.reset();
+    boost::asio::post(io_context_, [h, ec, result, ttl]() { h(ec, result, ttl); });
+  }
+
+  void on_timeout(query& q)
+  {
+    std::unique_ptr<query> p = take(*channels_[q.channel], q.id);
+
+    retry(std::move(p), boost::asio::error::timed_out);
+  }
+
+  // A socket only listens while it has queries out, an idle client leaves
+  // its io_context without work and a forked child can exit
+  void receive(channel& c)
+  {
+    c.receiving = true;
+    c.socket.async_receive(boost::asio::buffer(c.buffer, sizeof(c.buffer)),
+      [this, &c](boost::system::error_code ec, std::size_t length)
+      {
+        c.receiving = false;
+        if (ec == boost::asio::error::bad_descriptor) {
+          return;
+        }
+        // Refused means an ICMP error for some earlier query, it will time out
+        if (!ec) {
+          on_response(c, length);
+        }
+        if (!c.receiving && !c.pending.empty()) {
+          receive(c);
+        }
+      });
+  }
+
+  void on_response(channel& c, size_t length)
+  {
+    const unsigned char *p = (const unsigned char *)c.buffer;
+
+    if (length < header_size) {
+      return;
+    }
+
+    uint16_t id = p[0] << 8 | p[1];
+    auto it = c.pending.find(id);
+    if (it == c.pending.end() || !answers(*it->second, p, length)) {
+      return;
+    }
+
+    std::unique_ptr<query> q = take(c, id);
+    size_t question = q->packet.size() - header_size;
+    int rcode = p[3] & 0x0f;
+    addresses result;
+    std::chrono::seconds ttl(0);
+
+    if (rcode == rcode_nxdomain) {
+      finish(std::move(q), boost::asio::error::host_not_found, result, ttl);
+    } else if (rcode != rcode_ok) {
+      retry(std::move(q), boost::asio::error::host_not_found_try_again);
+    } else {
+      parse_answers(p, length, header_size + question, p[6] << 8 | p[7], result, ttl);
+      if (!result.empty()) {
+        finish(std::move(q), boost::system::error_code(), result, ttl);
+      } else if (p[2] & 0x02) {
+        // Truncated before the addresses, a bigger answer than we ask TCP for
+        finish(std::move(q), boost::asio::error::host_not_found_try_again, result, ttl);
+      } else {
+        finish(std::move(q), boost::asio::error::host_not_found, result, ttl);
+      }
+    }
+  }
+
+  // A response with our question, names compared without regard to case
+  static bool answers(const query& q, const unsigned char *p, size_t length)
+  {
+    size_t question = q.packet.size() - header_size;
+
+    if (!(p[2] & 0x80) || (p[4] << 8 | p[5]) != 1 || length < header_size + question) {
+      return false;
+    }
+    for (size_t i = header_size; i < header_size + question; ++i) {
+      if (tolower(p[i]) != tolower((unsigned char)q.packet[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The TTL is the smallest of the records on the way to the addresses, a
+  // CNAME may expire before the address it points to
+  static void parse_answers(const unsigned char *p, size_t length, size_t pos, int count, addresses& result,
+                            std::chrono::seconds& ttl)
+  {
+    uint32_t min_ttl = 0xffffffff;
+
+    for (int i = 0; i < count; ++i) {
+      // Owner name, labels ending in a zero length or a compression pointer
+      while (pos < length && p[pos] != 0 && (p[pos] & 0xc0) != 0xc0) {
+        pos += p[pos] + 1;
+      }
+      pos += (pos < length && p[pos] != 0) ? 2 : 1;
+      if (pos + 10 > length) {
+        return;
+      }
+
+      int type = p[pos] << 8 | p[pos + 1];
+      int klass = p[pos + 2] << 8 | p[pos + 3];
+      uint32_t record_ttl = (uint32_t)p[pos + 4] << 24 | p[pos + 5] << 16 | p[pos + 6] << 8 | p[pos + 7];
+      size_t rdlength = p[pos + 8] << 8 | p[pos + 9];
+
+      pos += 10;
+      if (pos + rdlength > length) {
+        break;
+      }
+      // CNAMEs are skipped, servers put the addresses they lead to after them
+      if (type == type_a && klass == class_in && rdlength == 4) {
+        boost::asio::ip::address_v4::bytes_type bytes = {{ p[pos], p[pos + 1], p[pos + 2], p[pos + 3] }};
+        result.push_back(boost::asio::ip::address_v4(bytes));
+      }
+      if (klass == class_in && (type == type_a || type == type_cname)) {
+        // Values with the top bit set are treated as zero (RFC 2181)
+        min_ttl = std::min(min_ttl, record_ttl & 0x80000000 ? 0 : record_ttl);
+      }
+      pos += rdlength;
+    }
+    ttl = std::chrono::seconds(result.empty() ? 0 : min_ttl);
+  }
+
+  boost::asio::io_context& io_context_;
+  timer_wheel& wheel_;
+  std::vector<std::unique_ptr<channel>> channels_;
+  size_t next_socket_;
+  std::mt19937 random_;
+  int ids_left_;
+};
+
+#endif // SOCKS_DNS_CLIENT_HPP
@@ -0,0 +1,487 @@
+//
+// firewall.hpp
+// ~~~~~~~~~~~~
+//
+// socks.conf compiled into an immutable rule table.
+//
+// The file is parsed once, and sessions match against a snapshot. Rules are
+// tried in file order and the first one that matches decides, requests that
+// no rule matches are rejected. An index per command over the destinations
+// (see acl_index.hpp) keeps large rule sets cheap.
+//
+// Reloading builds a new snapshot and swaps it in, so sessions that already
+// hold the old one are not affected. Bandwidth limits are part of the
+// snapshot, a reload starts them with fresh buckets. So are cached
+// decisions, a new snapshot never answers from the old rules. The cache
+// only holds (command, destination) verdicts, so it is skipped when a rule
+// also looks at the port, the client or the USERID.
+//
+
+#ifndef SOCKS_FIREWALL_HPP
+#define SOCKS_FIREWALL_HPP
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include <boost/lexical_cast.hpp>
+#include "acl_index.hpp"
+#include "decision_cache.hpp"
+#include "rate_limit.hpp"
+
+struct firewall_rule {
+  bool permit;
+  uint8_t command;       // 1: CONNECT, 2: BIND, 3: UDP ASSOCIATE
+  uint32_t addr;         // Destination, host byte order, already masked
+  uint32_t mask;
+  uint16_t port_first;   // Destination ports
+  uint16_t port_last;
+  uint32_t client_addr;  // Source, host byte order, already masked
+  uint32_t client_mask;
+  std::string user;      // SOCKS4 USERID, empty for anyone
+
+  // Anything beyond command and destination
+  bool narrowed() const
+  {
+    return port_first != 0 || port_last != 0xffff || client_mask != 0 || !user.empty();
+  }
+};
+
+// What a request is matched on
+struct firewall_request {
+  uint8_t command;
+  uint32_t addr;     // Destination, host byte order
+  uint16_t port;
+  uint32_t client;   // Host byte order
+  const char *user;  // "" without a USERID
+};
+
+class firewall_rules
+{
+public:
+  // Returns NULL if the file can't be read or has a bad rule
+  static std::shared_ptr<const firewall_rules> load(const std::string& filename)
+  {
+    std::ifstream firewallfile(filename);
+
+    if (firewallfile.fail()) {
+      std::cerr << "[x] " << filename << " doesn't exist" << std::endl;
+      std::cerr << "[*] socks.conf example:" << std::endl;
+      std::cerr << R""""(
+              # Allow comment
+              #
+              # format:
+              #   <permit|deny> <command> <address> [port <n>[-<m>]] [from <address>] [user <USERID>]
+              # command:
+              #   c: CONNECT
+              #   b: BIND
+              #   u: UDP ASSOCIATE (SOCKS5), checked for every datagram
+              # address: a.b.c.d, a.b.c.d/len or a.b.*.*
+              # the first rule that matches decides, no match rejects
+              #
+              # bandwidth, bytes per second with k/m/g suffix:
+              #   limit client <IPv4> <rate> [burst]    each client
+              #   limit user <USERID|*> <rate> [burst]  each USERID
+              #   limit dest <IPv4> <rate> [burst]      all tunnels to it
+              # buckets are kept per process, in fork mode (the default) every
+              # connection has its own and a limit caps each connection, use -t
+
+              # permit c 140.113.*.*
+              permit c *.*.*.*
+              permit b *.*.*.*
+              # limit client *.*.*.* 10m
+              )"""" << std::endl;
+      return NULL;
+    }
+
+    std::shared_ptr<firewall_rules> table = std::make_shared<firewall_rules>();
+    std::string line;
+
+    while (getline(firewallfile, line)) {
+      firewall_rule rule;
+
+      boost::algorithm::trim(line);
+
+      if (line.length() == 0 || line[0] == '#') {
+        continue;
+      }
+
+      if (line.compare(0, 6, "limit ") == 0 || line.compare(0, 6, "limit\t") == 0) {
+        rate_limit_rule limit;
+
+        if (parse_limit(line, limit) == -1) {
+          std::cerr << "[*] socks.conf limit parse error:" << line << std::endl;
+          return NULL;
+        }
+        table->limits_.add(limit);
+        continue;
+      }
+
+      if (parse_rule(line, rule) == -1) {
+        std::cerr << "[*] socks.conf rule parse error:" << line << std::endl;
+        return NULL;
+      }
+
+      table->add(rule);
+    }
+
+    return table;
+  }
+
+  firewall_rules()
+    : cacheable_(true),
+      uses_client_(false)
+  {
+  }
+
+  // Answered from the cache when the destination was seen before and the
+  // rules allow caching, hit tells which way it went
+  bool permit(const firewall_request& r, bool& hit) const
+  {
+    bool allowed = false;
+
+    hit = cacheable_ && cache_.find(r.command, r.addr, allowed);
+    if (!hit) {
+      allowed = match(r);
+      if (cacheable_) {
+        cache_.store(r.command, r.addr, allowed);
+      }
+    }
+    return allowed;
+  }
+
+  // False when some rule depends on more than command and destination
+  bool cacheable() const
+  {
+    return cacheable_;
+  }
+
+  // Some rule looks at the client address
+  bool uses_client() const
+  {
+    return uses_client_;
+  }
+
+  size_t size() const
+  {
+    return rules_.size();
+  }
+
+  const rate_limits& limits() const
+  {
+    return limits_;
+  }
+
+private:
+  enum { commands = 4 };
+
+  void add(const firewall_rule& rule)
+  {
+    index_[rule.command].add(rule.addr, rule.mask, rules_.size());
+    rules_.push_back(rule);
+    if (rule.narrowed()) {
+      cacheable_ = false;
+    }
+    if (rule.client_mask != 0) {
+      uses_client_ = true;
+    }
+  }
+
+  bool match(const firewall_request& r) const
+  {
+    if (r.command >= commands) {
+      return false;
+    }
+
+    uint32_t id = index_[r.command].find(r.addr,
+      [this, &r](uint32_t i)
+      {
+        const firewall_rule& rule = rules_[i];
+
+        // The trie only guarantees this for prefixes
+        return (r.addr & rule.mask) == rule.addr &&
+               r.port >= rule.port_first && r.port <= rule.port_last &&
+               (r.client & rule.client_mask) == rule.client_addr &&
+               (rule.user.empty() || rule.user == r.user);
+      });
+
+    return id != acl_index::none && rules_[id].permit;
+  }
+
+  // <permit|deny> <command> <address> [port <n>[-<m>]] [from <address>] [user <USERID>]
+  // e.g.
+  //   permit c 140.130.*.*
+  //   deny c 10.0.0.0/8
+  //   permit c 0.0.0.0/0 port 443 user alice
+  static int parse_rule(const std::string& line, firewall_rule& rule)
+  {
+    std::vector<std::string> params;
+
+    // "ACTION COMMAND IP"
+    boost::split(params, line, boost::is_any_of(" \t"), boost::token_compress_on);
+
+    if (params.size() < 3 || params.size() % 2 == 0 || params[1].length() != 1) {
+      return -1;
+    }
+
+    if (params[0] == "permit") {
+      rule.permit = true;
+    } else if (params[0] == "deny") {
+      rule.permit = false;
+    } else {
+      return -1;
+    }
+
+    switch (params[1][0]) {
+      case 'c':
+        rule.command = 1;
+        break;
+      case 'b':
+        rule.command = 2;
+        break;
+      case 'u':
+        rule.command = 3;
+        break;
+      default:
+        return -1;
+    }
+
+    rule.port_first = 0;
+    rule.port_last = 0xffff;
+    rule.client_addr = 0;
+    rule.client_mask = 0;
+    rule.user.clear();
+
+    if (parse_address(params[2], rule.addr, rule.mask) == -1) {
+      return -1;
+    }
+
+    for (size_t i = 3; i < params.size(); i += 2) {
+      const std::string& value = params[i + 1];
+
+      if (params[i] == "port") {
+        if (parse_ports(value, rule.port_first, rule.port_last) == -1) {
+          return -1;
+        }
+      } else if (params[i] == "from") {
+        if (parse_address(value, rule.client_addr, rule.client_mask) == -1) {
+          return -1;
+        }
+      } else if (params[i] == "user") {
+        rule.user = value;
+      } else {
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  // "<n>" or "<first>-<last>"
+  static int parse_ports(const std::string& text, uint16_t& first, uint16_t& last)
+  {
+    char *end = NULL;
+    unsigned long a = strtoul(text.c_str(), &end, 10);
+    unsigned long b = a;
+
+    if (end == text.c_str()) {
+      return -1;
+    }
+    if (*end == '-') {
+      const char *p = end + 1;
+      b = strtoul(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    if (*end || a > b || b > 0xffff) {
+      return -1;
+    }
+
+    first = a;
+    last = b;
+    return 0;
+  }
+
+  // limit <client|user|dest> <IPv4 or USERID> <rate> [burst]
+  // e.g.
+  //   limit client 140.113.*.* 1m
+  //   limit user alice 500k 1m
+  static int parse_limit(const std::string& line, rate_limit_rule& rule)
+  {
+    std::vector<std::string> params;
+
+    boost::split(params, line, boost::is_any_of(" \t"), boost::token_compress_on);
+
+    if (params.size() != 4 && params.size() != 5) {
+      return -1;
+    }
+
+    rule.addr = 0;
+    rule.mask = 0;
+
+    if (params[1] == "client" || params[1] == "dest") {
+      rule.key = params[1] == "client" ? rate_limit_rule::client : rate_limit_rule::dest;
+      if (parse_address(params[2], rule.addr, rule.mask) == -1) {
+        return -1;
+      }
+    } else if (params[1] == "user") {
+      rule.key = rate_limit_rule::user;
+      rule.name = params[2];
+    } else {
+      return -1;
+    }
+
+    rule.rate = parse_bytes(params[3]);
+    if (rule.rate == 0) {
+      return -1;
+    }
+
+    // A tenth of a second worth by default, at least one relay buffer
+    rule.burst = std::max<uint64_t>(rule.rate / 10, 0x10000);
+    if (params.size() == 5) {
+      rule.burst = parse_bytes(params[4]);
+      if (rule.burst == 0) {
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  // "<number/*>.<number/*>.<number/*>.<number/*>" or "a.b.c.d/len"
+  static int parse_address(const std::string& pattern, uint32_t& addr, uint32_t& mask)
+  {
+    std::vector<std::string> ips;
+    size_t slash = pattern.find('/');
+
+    if (slash != std::string::npos) {
+      return parse_cidr(pattern.substr(0, slash), pattern.substr(slash + 1), addr, mask);
+    }
+
+    boost::split(ips, pattern, boost::is_any_of("."), boost::token_compress_on);
+
+    if (ips.size() != 4) {
+      return -1;
+    }
+
+    addr = 0;
+    mask = 0;
+
+    for (int i = 0; i < 4; ++i) {
+      int shift = 24 - i * 8;
+
+      if (ips[i] == "*") {
+        continue;
+      }
+
+      try
+      {
+        int octet = boost::lexical_cast<int>(ips[i]);
+        if (octet < 0 || octet > 255) {
+          return -1;
+        }
+        addr |= (uint32_t)octet << shift;
+        mask |= (uint32_t)0xff << shift;
+      }
+      catch (std::exception& e)
+      {
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  static int parse_cidr(const std::string& ip, const std::string& length, uint32_t& addr, uint32_t& mask)
+  {
+    in_addr a;
+    char *end = NULL;
+    unsigned long bits = strtoul(length.c_str(), &end, 10);
+
+    if (inet_pton(AF_INET, ip.c_str(), &a) != 1 || end == length.c_str() || *end || bits > 32) {
+      return -1;
+    }
+
+    mask = bits == 0 ? 0 : ~(uint32_t)0 << (32 - bits);
+    addr = ntohl(a.s_addr) & mask;
+    return 0;
+  }
+
+  // "10m" is 10 * 2^20, 0 when malformed or too large
+  static uint64_t parse_bytes(const std::string& text)
+  {
+    char *end = NULL;
+    int shift = 0;
+
+    errno = 0;
+    uint64_t value = strtoull(text.c_str(), &end, 10);
+
+    if (end == text.c_str() || errno == ERANGE || text[0] == '-') {
+      return 0;
+    }
+    switch (*end) {
+      case 'k': case 'K': shift = 10; ++end; break;
+      case 'm': case 'M': shift = 20; ++end; break;
+      case 'g': case 'G': shift = 30; ++end; break;
+    }
+    // Values that don't fit are errors, not wrapped around
+    if (*end || value > (UINT64_MAX >> shift)) {
+      return 0;
+    }
+    return value << shift;
+  }
+
+  std::vector<firewall_rule> rules_;
+  acl_index index_[commands];
+  bool cacheable_;
+  bool uses_client_;
+  rate_limits limits_;
+  decision_cache cache_;
+};
+
+class firewall
+{
+public:
+  // The snapshot a new session should use
+  static std::shared_ptr<const firewall_rules> current()
+  {
+    return std::atomic_load(&rules());
+  }
+
+  // On failure the previous snapshot stays in place. Without any snapshot
+  // an empty table is installed, which rejects everything.
+  static bool reload(const std::string& filename)
+  {
+    std::shared_ptr<const firewall_rules> table = firewall_rules::load(filename);
+
+    if (!table) {
+      if (!current()) {
+        std::atomic_store(&rules(), std::shared_ptr<const firewall_rules>(new firewall_rules()));
+      }
+      return false;
+    }
+
+    std::atomic_store(&rules(), table);
+    return true;
+  }
+
+private:
+  // Never destroyed: a child forked per connection would otherwise free a
+  // large table on its way out, one allocation at a time
+  static std::shared_ptr<const firewall_rules>& rules()
+  {
+    static std::shared_ptr<const firewall_rules> *rules_ = new std::shared_ptr<const firewall_rules>();
+    return *rules_;
+  }
+};
+
+#endif // SOCKS_FIREWALL_HPP
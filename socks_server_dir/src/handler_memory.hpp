@@ -0,0 +1,181 @@
+//
+// handler_memory.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Per-thread recycling of asio handler memory.
+//
+// Every async operation allocates a block for itself and its handler and
+// frees it right before the handler runs. asio keeps only a couple of such
+// blocks per thread, with more than a few tunnels on a thread most waits
+// and writes of the relay went to the heap. Handlers wrapped with recycle()
+// take their blocks from free lists in 64 byte size classes instead, which
+// hold up to cache_limit() bytes per thread. The lists are intrusive, so
+// neither side of the cache allocates. Blocks are ordinary operator new
+// memory and may be given back on another thread than the one that took
+// them.
+//
+
+#ifndef SOCKS_HANDLER_MEMORY_HPP
+#define SOCKS_HANDLER_MEMORY_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+class handler_memory
+{
+public:
+  // Larger blocks always come from the heap
+  enum { granularity = 64, classes = 16 };
+
+  // The calling thread's cache. Never freed, operations destroyed at exit
+  // may still give blocks back to it.
+  static handler_memory& local()
+  {
+    static thread_local handler_memory *memory = NULL;
+
+    if (!memory) {
+      memory = new handler_memory();
+    }
+    return *memory;
+  }
+
+  void *allocate(std::size_t size)
+  {
+    int cls = size_class(size);
+
+    if (cls >= classes) {
+      return ::operator new(size);
+    }
+    if (block *b = free_[cls]) {
+      free_[cls] = b->next;
+      cached_ -= class_size(cls);
+      return b;
+    }
+    return ::operator new(class_size(cls));
+  }
+
+  void deallocate(void *p, std::size_t size)
+  {
+    int cls = size_class(size);
+
+    if (cls >= classes || cached_ + class_size(cls) > cache_limit()) {
+      ::operator delete(p);
+      return;
+    }
+
+    block *b = static_cast<block *>(p);
+    b->next = free_[cls];
+    free_[cls] = b;
+    cached_ += class_size(cls);
+  }
+
+  // Upper bound of bytes each thread keeps cached
+  static std::size_t& cache_limit()
+  {
+    static std::size_t limit = (std::size_t)1 << 20;
+    return limit;
+  }
+
+private:
+  struct block {
+    block *next;
+  };
+
+  handler_memory()
+    : cached_(0)
+  {
+    for (block *& list : free_) {
+      list = NULL;
+    }
+  }
+
+  static int size_class(std::size_t size)
+  {
+    return size == 0 ? 0 : (int)((size - 1) / granularity);
+  }
+
+  static std::size_t class_size(int cls)
+  {
+    return (std::size_t)(cls + 1) * granularity;
+  }
+
+  block *free_[classes];
+  std::size_t cached_;
+};
+
+// Standard allocator over the calling thread's handler_memory
+template <typename T>
+class handler_allocator
+{
+public:
+  typedef T value_type;
+
+  handler_allocator() noexcept
+  {
+  }
+
+  template <typename U>
+  handler_allocator(const handler_allocator<U>&) noexcept
+  {
+  }
+
+  T *allocate(std::size_t n)
+  {
+    return static_cast<T *>(handler_memory::local().allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n)
+  {
+    handler_memory::local().deallocate(p, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const handler_allocator<U>&) const noexcept
+  {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const handler_allocator<U>&) const noexcept
+  {
+    return false;
+  }
+};
+
+// A handler whose associated allocator is handler_allocator, asio picks it
+// up for the operation and for composed operations built on it
+template <typename Handler>
+class recycled_handler
+{
+public:
+  typedef handler_allocator<void> allocator_type;
+
+  explicit recycled_handler(Handler handler)
+    : handler_(std::move(handler))
+  {
+  }
+
+  allocator_type get_allocator() const noexcept
+  {
+    return allocator_type();
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args)
+  {
+    handler_(std::forward<Args>(args)...);
+  }
+
+private:
+  Handler handler_;
+};
+
+template <typename Handler>
+recycled_handler<typename std::decay<Handler>::type> recycle(Handler&& handler)
+{
+  return recycled_handler<typename std::decay<Handler>::type>(std::forward<Handler>(handler));
+}
+
+#endif // SOCKS_HANDLER_MEMORY_HPP
@@ -0,0 +1,187 @@
+//
+// handoff.hpp
+// ~~~~~~~~~~~
+//
+// Listening socket handoff for binary upgrades.
+//
+// The running server listens on a Unix socket, mode 0600, and only talks to
+// peers running as its own user. A new process started with the same path
+// connects, asks for the listeners and gets them as SCM_RIGHTS descriptors,
+// so the kernel's accept queues are never closed. Once the new process
+// confirms, the old one stops accepting and drops the connection, which tells
+// the new process the path is free to take, and then drains its sessions.
+//
+// request:  "SKUP"
+// reply:    header, the descriptors ride along with it
+// confirm:  one byte
+//
+
+#ifndef SOCKS_HANDOFF_HPP
+#define SOCKS_HANDOFF_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class handoff
+{
+public:
+  enum { max_sockets = 64, timeout_sec = 5 };
+
+  struct sockets {
+    std::vector<int> listeners;  // SOCKS listeners, one per worker with --reuseport
+    int metrics = -1;
+  };
+
+  static const char *request()
+  {
+    return "SKUP";
+  }
+
+  // Sends the header with the descriptors attached
+  static bool send(int fd, const sockets& s)
+  {
+    header h;
+    std::vector<int> fds(s.listeners);
+
+    memcpy(h.magic, request(), sizeof(h.magic));
+    h.listeners = s.listeners.size();
+    h.metrics = s.metrics != -1 ? 1 : 0;
+    if (s.metrics != -1) {
+      fds.push_back(s.metrics);
+    }
+    if (fds.size() > max_sockets) {
+      return false;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * max_sockets)];
+    iovec iov = { &h, sizeof(h) };
+    msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cm), fds.data(), sizeof(int) * fds.size());
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(h);
+  }
+
+  // Only the user the server runs as may take its listeners
+  static bool trusted_peer(int fd)
+  {
+    ucred cred;
+    socklen_t length = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1 || length != sizeof(cred)) {
+      return false;
+    }
+    return cred.uid == geteuid();
+  }
+
+  // Connects to a running server on path and takes its listeners. Returns
+  // the connection to confirm on, -1 when nobody is there or the exchange
+  // failed.
+  static int take_over(const std::string& path, sockets& s)
+  {
+    sockaddr_un addr;
+    int fd;
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      return -1;
+    }
+
+    timeval timeout = { timeout_sec, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1 ||
+        ::send(fd, request(), 4, MSG_NOSIGNAL) != 4 ||
+        !receive(fd, s)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  // Tells the old process the listeners are in use and waits until it has
+  // let go of the path
+  static void release(int fd)
+  {
+    char c = 1;
+
+    if (::send(fd, &c, 1, MSG_NOSIGNAL) == 1) {
+      while (read(fd, &c, 1) > 0) {}
+    }
+    close(fd);
+  }
+
+private:
+  struct header {
+    char magic[4];
+    uint32_t listeners;
+    uint32_t metrics;
+  };
+
+  static bool receive(int fd, sockets& s)
+  {
+    char control[CMSG_SPACE(sizeof(int) * max_sockets)];
+    header h;
+    iovec iov = { &h, sizeof(h) };
+    msghdr msg;
+    std::vector<int> fds;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t old = fds.size();
+        fds.resize(old + count);
+        memcpy(&fds[old], CMSG_DATA(cm), sizeof(int) * count);
+      }
+    }
+
+    if (n != (ssize_t)sizeof(h) || memcmp(h.magic, request(), sizeof(h.magic)) != 0 ||
+        (msg.msg_flags & MSG_CTRUNC) || fds.size() != h.listeners + h.metrics ||
+        h.listeners == 0) {
+      for (int f : fds) {
+        close(f);
+      }
+      return false;
+    }
+
+    s.listeners.assign(fds.begin(), fds.begin() + h.listeners);
+    s.metrics = h.metrics ? fds.back() : -1;
+    return true;
+  }
+};
+
+#endif // SOCKS_HANDOFF_HPP
@@ -0,0 +1,308 @@
+//
+// metrics.hpp
+// ~~~~~~~~~~~
+//
+// Session counters and phase latency histograms.
+//
+// Every thread updates its own block of counters with relaxed atomics, so
+// nothing on the relay path contends. Blocks register themselves once and
+// are summed when the metrics are scraped. Histograms are log-linear: two
+// buckets per power of two microseconds, about 41% wide each.
+//
+
+#ifndef SOCKS_METRICS_HPP
+#define SOCKS_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Only the owning thread writes, so a relaxed load/store pair is enough
+inline void metrics_add(std::atomic<uint64_t>& counter, uint64_t n)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class latency_histogram
+{
+public:
+  enum { sub_bits = 1, octaves = 27, buckets = (octaves << sub_bits) + 1 };
+
+  latency_histogram()
+  {
+    for (auto& c : counts_) {
+      c = 0;
+    }
+    sum_us_ = 0;
+  }
+
+  void record(std::chrono::steady_clock::duration d)
+  {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+
+    metrics_add(counts_[bucket(us)], 1);
+    metrics_add(sum_us_, us);
+  }
+
+  // Upper bound in microseconds of bucket i, the last one is unbounded.
+  // Bucket 0 is unused, bucket 1 takes everything below 2us.
+  static uint64_t upper_bound(int i)
+  {
+    if (i < 2) {
+      return 1;
+    }
+
+    int octave = i >> sub_bits;
+    uint64_t base = (uint64_t)1 << octave;
+    return base + ((base >> sub_bits) * ((i & ((1 << sub_bits) - 1)) + 1)) - 1;
+  }
+
+  struct snapshot {
+    uint64_t counts[buckets] = {};
+    uint64_t sum_us = 0;
+
+    snapshot& operator+=(const latency_histogram& h)
+    {
+      for (int i = 0; i < buckets; ++i) {
+        counts[i] += h.counts_[i].load(std::memory_order_relaxed);
+      }
+      sum_us += h.sum_us_.load(std::memory_order_relaxed);
+      return *this;
+    }
+  };
+
+private:
+  static int bucket(uint64_t us)
+  {
+    if (us < 2) {
+      return 1;
+    }
+
+    int octave = 63 - __builtin_clzll(us);
+    if (octave >= octaves) {
+      return buckets - 1;
+    }
+
+    int sub = (us >> (octave - sub_bits)) & ((1 << sub_bits) - 1);
+    return (octave << sub_bits) + sub;
+  }
+
+  std::atomic<uint64_t> counts_[buckets];
+  std::atomic<uint64_t> sum_us_;
+};
+
+class metrics
+{
+public:
+  // Session state machine, each phase is timed from the end of the previous
+  enum phase_t { parse, resolve, firewall, connect, reply, phases };
+
+  struct counters {
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> closed;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> resolve_failures;
+    std::atomic<uint64_t> connect_failures;
+    std::atomic<uint64_t> handshake_timeouts;
+    std::atomic<uint64_t> connect_timeouts;
+    std::atomic<uint64_t> idle_timeouts;
+    std::atomic<uint64_t> bytes_upstream;    // Client to server
+    std::atomic<uint64_t> bytes_downstream;  // Server to client
+    std::atomic<uint64_t> datagrams_upstream;
+    std::atomic<uint64_t> datagrams_downstream;
+    std::atomic<uint64_t> datagrams_dropped;
+    std::atomic<uint64_t> firewall_cache_hits;
+    std::atomic<uint64_t> firewall_cache_misses;
+  };
+
+  struct block {
+    block()
+    {
+      c.accepted = 0;
+      c.closed = 0;
+      c.rejected = 0;
+      c.resolve_failures = 0;
+      c.connect_failures = 0;
+      c.handshake_timeouts = 0;
+      c.connect_timeouts = 0;
+      c.idle_timeouts = 0;
+      c.bytes_upstream = 0;
+      c.bytes_downstream = 0;
+      c.datagrams_upstream = 0;
+      c.datagrams_downstream = 0;
+      c.datagrams_dropped = 0;
+      c.firewall_cache_hits = 0;
+      c.firewall_cache_misses = 0;
+    }
+
+    counters c;
+    latency_histogram phase[phases];
+    latency_histogram connect_attempt;
+  };
+
+  struct totals {
+    uint64_t accepted = 0;
+    uint64_t closed = 0;
+    uint64_t rejected = 0;
+    uint64_t resolve_failures = 0;
+    uint64_t connect_failures = 0;
+    uint64_t handshake_timeouts = 0;
+    uint64_t connect_timeouts = 0;
+    uint64_t idle_timeouts = 0;
+    uint64_t bytes_upstream = 0;
+    uint64_t bytes_downstream = 0;
+    uint64_t datagrams_upstream = 0;
+    uint64_t datagrams_downstream = 0;
+    uint64_t datagrams_dropped = 0;
+    uint64_t firewall_cache_hits = 0;
+    uint64_t firewall_cache_misses = 0;
+    latency_histogram::snapshot phase[phases];
+    latency_histogram::snapshot connect_attempt;
+
+    totals& operator+=(const block& b)
+    {
+      accepted += b.c.accepted.load(std::memory_order_relaxed);
+      closed += b.c.closed.load(std::memory_order_relaxed);
+      rejected += b.c.rejected.load(std::memory_order_relaxed);
+      resolve_failures += b.c.resolve_failures.load(std::memory_order_relaxed);
+      connect_failures += b.c.connect_failures.load(std::memory_order_relaxed);
+      handshake_timeouts += b.c.handshake_timeouts.load(std::memory_order_relaxed);
+      connect_timeouts += b.c.connect_timeouts.load(std::memory_order_relaxed);
+      idle_timeouts += b.c.idle_timeouts.load(std::memory_order_relaxed);
+      bytes_upstream += b.c.bytes_upstream.load(std::memory_order_relaxed);
+      bytes_downstream += b.c.bytes_downstream.load(std::memory_order_relaxed);
+      datagrams_upstream += b.c.datagrams_upstream.load(std::memory_order_relaxed);
+      datagrams_downstream += b.c.datagrams_downstream.load(std::memory_order_relaxed);
+      datagrams_dropped += b.c.datagrams_dropped.load(std::memory_order_relaxed);
+      firewall_cache_hits += b.c.firewall_cache_hits.load(std::memory_order_relaxed);
+      firewall_cache_misses += b.c.firewall_cache_misses.load(std::memory_order_relaxed);
+      for (int i = 0; i < phases; ++i) {
+        phase[i] += b.phase[i];
+      }
+      connect_attempt += b.connect_attempt;
+      return *this;
+    }
+  };
+
+  // The calling thread's block, blocks are never freed so scrapes can read
+  // them after their thread has exited
+  static block& local()
+  {
+    static thread_local block *b = NULL;
+
+    if (!b) {
+      b = new block();
+      std::lock_guard<std::mutex> lock(mutex());
+      registry().push_back(b);
+    }
+    return *b;
+  }
+
+  static totals total()
+  {
+    std::lock_guard<std::mutex> lock(mutex());
+    totals t;
+
+    for (block *b : registry()) {
+      t += *b;
+    }
+    return t;
+  }
+
+  static const char *phase_name(int p)
+  {
+    static const char *names[] = { "parse", "resolve", "firewall", "connect", "reply" };
+    return names[p];
+  }
+
+  // Prometheus text exposition of the session metrics
+  static void write_prometheus(std::ostream& os)
+  {
+    totals t = total();
+
+    counter(os, "socks_sessions_accepted_total", "Sessions accepted", t.accepted);
+    os << "# HELP socks_sessions_active Sessions currently open\n"
+       << "# TYPE socks_sessions_active gauge\n"
+       << "socks_sessions_active " << (t.accepted - t.closed) << "\n";
+    counter(os, "socks_requests_rejected_total", "Requests rejected by the firewall", t.rejected);
+    counter(os, "socks_resolve_failures_total", "Hostname lookups that failed", t.resolve_failures);
+    counter(os, "socks_connect_failures_total", "CONNECT requests where every attempt failed", t.connect_failures);
+
+    os << "# HELP socks_timeouts_total Sessions closed by a timeout\n"
+       << "# TYPE socks_timeouts_total counter\n"
+       << "socks_timeouts_total{phase=\"handshake\"} " << t.handshake_timeouts << "\n"
+       << "socks_timeouts_total{phase=\"connect\"} " << t.connect_timeouts << "\n"
+       << "socks_timeouts_total{phase=\"idle\"} " << t.idle_timeouts << "\n";
+
+    os << "# HELP socks_relay_bytes_total Bytes relayed\n"
+       << "# TYPE socks_relay_bytes_total counter\n"
+       << "socks_relay_bytes_total{direction=\"upstream\"} " << t.bytes_upstream << "\n"
+       << "socks_relay_bytes_total{direction=\"downstream\"} " << t.bytes_downstream << "\n";
+
+    os << "# HELP socks_udp_datagrams_total UDP ASSOCIATE datagrams relayed or dropped\n"
+       << "# TYPE socks_udp_datagrams_total counter\n"
+       << "socks_udp_datagrams_total{direction=\"upstream\"} " << t.datagrams_upstream << "\n"
+       << "socks_udp_datagrams_total{direction=\"downstream\"} " << t.datagrams_downstream << "\n"
+       << "socks_udp_datagrams_total{direction=\"dropped\"} " << t.datagrams_dropped << "\n";
+
+    os << "# HELP socks_firewall_cache_lookups_total Firewall decisions by cache outcome\n"
+       << "# TYPE socks_firewall_cache_lookups_total counter\n"
+       << "socks_firewall_cache_lookups_total{result=\"hit\"} " << t.firewall_cache_hits << "\n"
+       << "socks_firewall_cache_lookups_total{result=\"miss\"} " << t.firewall_cache_misses << "\n";
+
+    os << "# HELP socks_phase_seconds Time spent in each session phase\n"
+       << "# TYPE socks_phase_seconds histogram\n";
+    for (int i = 0; i < phases; ++i) {
+      std::string label = std::string("phase=\"") + phase_name(i) + "\"";
+      histogram(os, "socks_phase_seconds", label, t.phase[i]);
+    }
+
+    os << "# HELP socks_connect_attempt_seconds Time until each connect attempt finished\n"
+       << "# TYPE socks_connect_attempt_seconds histogram\n";
+    histogram(os, "socks_connect_attempt_seconds", "", t.connect_attempt);
+  }
+
+  static void counter(std::ostream& os, const char *name, const char *help, uint64_t value)
+  {
+    os << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " counter\n"
+       << name << " " << value << "\n";
+  }
+
+private:
+  static void histogram(std::ostream& os, const char *name, const std::string& label,
+                        const latency_histogram::snapshot& s)
+  {
+    std::string sep = label.empty() ? "" : ",";
+    std::string braces = label.empty() ? "" : "{" + label + "}";
+    uint64_t cumulative = 0;
+
+    for (int i = 1; i < latency_histogram::buckets - 1; ++i) {
+      cumulative += s.counts[i];
+      os << name << "_bucket{" << label << sep << "le=\""
+         << (latency_histogram::upper_bound(i) + 1) / 1e6 << "\"} " << cumulative << "\n";
+    }
+    cumulative += s.counts[latency_histogram::buckets - 1];
+    os << name << "_bucket{" << label << sep << "le=\"+Inf\"} " << cumulative << "\n"
+       << name << "_sum" << braces << " " << s.sum_us / 1e6 << "\n"
+       << name << "_count" << braces << " " << cumulative << "\n";
+  }
+
+  static std::vector<block *>& registry()
+  {
+    static std::vector<block *> blocks;
+    return blocks;
+  }
+
+  static std::mutex& mutex()
+  {
+    static std::mutex m;
+    return m;
+  }
+};
+
+#endif // SOCKS_METRICS_HPP
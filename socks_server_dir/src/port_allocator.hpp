@@ -0,0 +1,138 @@
+//
+// port_allocator.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Hands out listening ports for BIND from a fixed range.
+//
+// Free ports sit in a FIFO, so allocate and release are O(1) and a port that
+// turned out to be taken by someone else goes to the back of the line. A
+// bitmap catches ports released twice.
+//
+
+#ifndef SOCKS_PORT_ALLOCATOR_HPP
+#define SOCKS_PORT_ALLOCATOR_HPP
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+class port_allocator
+{
+public:
+  struct totals {
+    uint64_t allocations = 0;
+    uint64_t exhausted = 0;     // Nothing free when asked
+    uint64_t busy = 0;          // Port taken outside the allocator
+    uint64_t latency_ns = 0;    // Sum over allocations, including retries
+    uint64_t max_latency_ns = 0;
+    uint64_t in_use = 0;
+  };
+
+  static port_allocator& instance()
+  {
+    static port_allocator allocator;
+    return allocator;
+  }
+
+  port_allocator()
+  {
+    configure(0x5566, 0xffff);
+  }
+
+  // Only while no port is handed out
+  void configure(uint16_t first, uint16_t last)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    first_ = first;
+    free_.clear();
+    in_use_.assign((size_t)last - first + 1, false);
+    for (uint32_t port = first; port <= last; ++port) {
+      free_.push_back(port);
+    }
+  }
+
+  size_t size() const
+  {
+    return in_use_.size();
+  }
+
+  // Returns 0 when the range is used up
+  uint16_t allocate()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (free_.empty()) {
+      ++stats_.exhausted;
+      return 0;
+    }
+
+    uint16_t port = free_.front();
+    free_.pop_front();
+    in_use_[port - first_] = true;
+    ++stats_.in_use;
+    return port;
+  }
+
+  void release(uint16_t port)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (port < first_ || port - first_ >= (int)in_use_.size() || !in_use_[port - first_]) {
+      return;
+    }
+
+    in_use_[port - first_] = false;
+    free_.push_back(port);
+    --stats_.in_use;
+  }
+
+  // Someone else holds the port, try it again later
+  void release_busy(uint16_t port)
+  {
+    release(port);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.busy;
+  }
+
+  void record(uint64_t latency_ns)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    ++stats_.allocations;
+    stats_.latency_ns += latency_ns;
+    if (latency_ns > stats_.max_latency_ns) {
+      stats_.max_latency_ns = latency_ns;
+    }
+  }
+
+  totals total()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+  void dump_stats(std::ostream& os)
+  {
+    totals t = total();
+
+    os << "bind_ports allocations=" << t.allocations
+       << " exhausted=" << t.exhausted
+       << " busy=" << t.busy
+       << " in_use=" << t.in_use
+       << " avg_latency_ns=" << (t.allocations ? t.latency_ns / t.allocations : 0)
+       << " max_latency_ns=" << t.max_latency_ns << "\n";
+  }
+
+private:
+  std::mutex mutex_;
+  uint16_t first_;
+  std::deque<uint16_t> free_;
+  std::vector<bool> in_use_;
+  totals stats_;
+};
+
+#endif // SOCKS_PORT_ALLOCATOR_HPP
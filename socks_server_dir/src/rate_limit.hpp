@@ -0,0 +1,200 @@
+//
+// rate_limit.hpp
+// ~~~~~~~~~~~~~~
+//
+// Token bucket bandwidth limits from socks.conf.
+//
+// Buckets use GCRA: the whole state is one theoretical arrival time, moved
+// forward with a CAS, so worker threads share a bucket without a lock. Relayed
+// bytes are always charged after they were read, the bucket only tells the
+// caller how long to hold off the next read.
+//
+// Rules are keyed by client address, USERID or destination. Client and user
+// rules give every client or user its own bucket, a destination rule has one
+// bucket for everything it matches. Buckets are per process: in fork mode
+// every connection relays in a child of its own, so each limit caps single
+// connections rather than a client, user or destination.
+//
+
+#ifndef SOCKS_RATE_LIMIT_HPP
+#define SOCKS_RATE_LIMIT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class token_bucket
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  // rate and burst in bytes
+  token_bucket(uint64_t rate, uint64_t burst)
+    : rate_(rate),
+      tau_(burst_time(rate, burst)),
+      tat_(0)
+  {
+  }
+
+  // Takes n bytes, returns how long to wait before reading more
+  std::chrono::nanoseconds charge(size_t n)
+  {
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      clock::now().time_since_epoch()).count();
+    uint64_t cost = (uint64_t)n * 1000000000 / rate_;
+    uint64_t tat = tat_.load(std::memory_order_relaxed);
+    uint64_t next;
+
+    do {
+      next = std::max(tat, now) + cost;
+    } while (!tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+
+    return std::chrono::nanoseconds(next - now > tau_ ? next - now - tau_ : 0);
+  }
+
+private:
+  // burst * 10^9 / rate without overflowing, a burst worth more than a
+  // century is as good as unlimited
+  static uint64_t burst_time(uint64_t rate, uint64_t burst)
+  {
+    static const uint64_t max_tau = (uint64_t)1 << 62;
+    double tau = (double)burst * 1e9 / (double)rate;
+
+    return tau >= (double)max_tau ? max_tau : (uint64_t)tau;
+  }
+
+  uint64_t rate_;
+  uint64_t tau_;              // Burst as time, nanoseconds
+  std::atomic<uint64_t> tat_; // Theoretical arrival time, nanoseconds
+};
+
+struct rate_limit_rule {
+  enum key_t { client, user, dest };
+
+  key_t key;
+  uint32_t addr;     // client and dest: host byte order, already masked
+  uint32_t mask;
+  std::string name;  // user: USERID, "*" for everyone
+  uint64_t rate;     // Bytes per second
+  uint64_t burst;
+};
+
+class rate_limits
+{
+public:
+  typedef std::vector<std::shared_ptr<token_bucket>> buckets;
+
+  enum { shards = 16 };
+
+  bool empty() const
+  {
+    return rules_.empty();
+  }
+
+  size_t size() const
+  {
+    return rules_.size();
+  }
+
+  void add(const rate_limit_rule& rule)
+  {
+    rules_.emplace_back(new rule_state(rule));
+  }
+
+  // Every bucket a tunnel is charged to, addresses in host byte order
+  void lookup(uint32_t client, const std::string& user, bool dest_v4, uint32_t dest,
+              buckets& out) const
+  {
+    for (const std::unique_ptr<rule_state>& state : rules_) {
+      const rate_limit_rule& rule = state->rule;
+
+      switch (rule.key) {
+        case rate_limit_rule::client:
+          if ((client & rule.mask) == rule.addr) {
+            out.push_back(state->get(std::string((const char *)&client, sizeof(client))));
+          }
+          break;
+        case rate_limit_rule::user:
+          if (rule.name == "*" || rule.name == user) {
+            out.push_back(state->get(user));
+          }
+          break;
+        case rate_limit_rule::dest:
+          if (dest_v4 && (dest & rule.mask) == rule.addr) {
+            out.push_back(state->shared);
+          }
+          break;
+      }
+    }
+  }
+
+  // The longest wait any of the buckets asks for
+  static std::chrono::nanoseconds charge(const buckets& b, size_t n)
+  {
+    std::chrono::nanoseconds delay(0);
+
+    for (const std::shared_ptr<token_bucket>& bucket : b) {
+      delay = std::max(delay, bucket->charge(n));
+    }
+    return delay;
+  }
+
+private:
+  // Buckets live as long as a session uses them, the maps only hold weak
+  // references and are swept when they have grown
+  struct rule_state {
+    explicit rule_state(const rate_limit_rule& rule)
+      : rule(rule)
+    {
+      if (rule.key == rate_limit_rule::dest) {
+        shared = std::make_shared<token_bucket>(rule.rate, rule.burst);
+      }
+    }
+
+    std::shared_ptr<token_bucket> get(const std::string& key)
+    {
+      shard& s = shards_[std::hash<std::string>()(key) % shards];
+      std::lock_guard<std::mutex> lock(s.mutex);
+      std::weak_ptr<token_bucket>& slot = s.buckets[key];
+      std::shared_ptr<token_bucket> bucket = slot.lock();
+
+      if (!bucket) {
+        bucket = std::make_shared<token_bucket>(rule.rate, rule.burst);
+        slot = bucket;
+
+        if (s.buckets.size() >= s.sweep_at) {
+          for (auto it = s.buckets.begin(); it != s.buckets.end(); ) {
+            if (it->second.expired()) {
+              it = s.buckets.erase(it);
+            } else {
+              ++it;
+            }
+          }
+          s.sweep_at = std::max<size_t>(64, s.buckets.size() * 2);
+        }
+      }
+      return bucket;
+    }
+
+    struct shard {
+      std::mutex mutex;
+      std::unordered_map<std::string, std::weak_ptr<token_bucket>> buckets;
+      size_t sweep_at = 64;
+    };
+
+    rate_limit_rule rule;
+    std::shared_ptr<token_bucket> shared;
+    shard shards_[shards];
+  };
+
+  std::vector<std::unique_ptr<rule_state>> rules_;
+};
+
+#endif // SOCKS_RATE_LIMIT_HPP
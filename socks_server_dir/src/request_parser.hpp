@@ -0,0 +1,370 @@
+//
+// request_parser.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Resumable SOCKS4/4A and SOCKS5 request parsers.
+//
+// Bytes can be fed in any number of pieces. Fields are copied into fixed
+// size members as they arrive, so the parsers never allocate and never read
+// past what they were given. consume() reports how much of the input belonged
+// to the request, anything after that is payload the client sent early.
+//
+
+#ifndef SOCKS_REQUEST_PARSER_HPP
+#define SOCKS_REQUEST_PARSER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class socks4_request_parser
+{
+public:
+  enum result_t { need_more, done, error };
+  enum { max_userid = 255, max_domain = 255 };
+
+  socks4_request_parser()
+    : state_(header),
+      header_length_(0),
+      userid_length_(0),
+      domain_length_(0)
+  {
+    userid_[0] = 0;
+    domain_[0] = 0;
+  }
+
+  // used is set to the number of bytes taken from data
+  result_t consume(const char *data, size_t length, size_t& used)
+  {
+    used = 0;
+
+    while (used < length) {
+      char c = data[used];
+
+      switch (state_) {
+        case header: {
+          size_t n = std::min(length - used, sizeof(header_) - header_length_);
+          memcpy(header_ + header_length_, data + used, n);
+          header_length_ += n;
+          used += n;
+          if (header_length_ == sizeof(header_)) {
+            if (version() != 4) {
+              state_ = failed;
+              return error;
+            }
+            state_ = userid;
+          }
+          break;
+        }
+        case userid:
+          ++used;
+          if (c == 0) {
+            userid_[userid_length_] = 0;
+            if (!socks4a()) {
+              state_ = complete;
+              return done;
+            }
+            state_ = domain;
+          } else if (userid_length_ == max_userid) {
+            state_ = failed;
+            return error;
+          } else {
+            userid_[userid_length_++] = c;
+          }
+          break;
+        case domain:
+          ++used;
+          if (c == 0) {
+            domain_[domain_length_] = 0;
+            if (domain_length_ == 0) {
+              state_ = failed;
+              return error;
+            }
+            state_ = complete;
+            return done;
+          } else if (domain_length_ == max_domain) {
+            state_ = failed;
+            return error;
+          } else {
+            domain_[domain_length_++] = c;
+          }
+          break;
+        case complete:
+          return done;
+        case failed:
+          return error;
+      }
+    }
+
+    return state_ == complete ? done : (state_ == failed ? error : need_more);
+  }
+
+  uint8_t version() const
+  {
+    return header_[0];
+  }
+
+  uint8_t command() const
+  {
+    return header_[1];
+  }
+
+  // Host byte order
+  uint16_t port() const
+  {
+    return ((uint8_t)header_[2] << 8) | (uint8_t)header_[3];
+  }
+
+  // Network byte order, as it was on the wire
+  uint32_t address() const
+  {
+    uint32_t ip;
+    memcpy(&ip, header_ + 4, sizeof(ip));
+    return ip;
+  }
+
+  // 0.0.0.x means a domain name follows the user id
+  bool socks4a() const
+  {
+    return header_[4] == 0 && header_[5] == 0 && header_[6] == 0;
+  }
+
+  const char *user_id() const
+  {
+    return userid_;
+  }
+
+  const char *domain_name() const
+  {
+    return domain_;
+  }
+
+private:
+  enum state_t { header, userid, domain, complete, failed };
+
+  state_t state_;
+  char header_[8];
+  size_t header_length_;
+  char userid_[max_userid + 1];
+  size_t userid_length_;
+  char domain_[max_domain + 1];
+  size_t domain_length_;
+};
+
+// SOCKS5 (RFC 1928): method negotiation, then the request. consume()
+// returns done once for each, stage() tells which one just finished.
+class socks5_request_parser
+{
+public:
+  enum result_t { need_more, done, error };
+  enum stage_t { greeting, request, complete };
+  enum { max_domain = 255 };
+
+  enum { connect = 1, bind = 2, udp_associate = 3 };
+  enum { atyp_ipv4 = 1, atyp_domain = 3, atyp_ipv6 = 4 };
+  enum { method_no_auth = 0x00, method_none = 0xff };
+
+  // REP field of the reply
+  enum {
+    succeeded = 0,
+    general_failure = 1,
+    not_allowed = 2,
+    network_unreachable = 3,
+    host_unreachable = 4,
+    connection_refused = 5,
+    ttl_expired = 6,
+    command_not_supported = 7,
+    address_not_supported = 8
+  };
+
+  socks5_request_parser()
+    : state_(g_version),
+      stage_(greeting),
+      methods_left_(0),
+      no_auth_(false),
+      command_(0),
+      atyp_(0),
+      addr_length_(0),
+      addr_have_(0),
+      port_have_(0),
+      failure_(general_failure)
+  {
+    domain_[0] = 0;
+  }
+
+  // used is set to the number of bytes taken from data
+  result_t consume(const char *data, size_t length, size_t& used)
+  {
+    used = 0;
+
+    while (used < length) {
+      uint8_t c = data[used++];
+
+      switch (state_) {
+        case g_version:
+          if (c != 5) {
+            return fail(general_failure);
+          }
+          state_ = g_nmethods;
+          break;
+        case g_nmethods:
+          methods_left_ = c;
+          if (methods_left_ == 0) {
+            return fail(general_failure);
+          }
+          state_ = g_methods;
+          break;
+        case g_methods:
+          if (c == method_no_auth) {
+            no_auth_ = true;
+          }
+          if (--methods_left_ == 0) {
+            state_ = r_version;
+            stage_ = request;
+            return done;
+          }
+          break;
+        case r_version:
+          if (c != 5) {
+            return fail(general_failure);
+          }
+          state_ = r_command;
+          break;
+        case r_command:
+          if (c != connect && c != bind && c != udp_associate) {
+            return fail(command_not_supported);
+          }
+          command_ = c;
+          state_ = r_reserved;
+          break;
+        case r_reserved:
+          state_ = r_atyp;
+          break;
+        case r_atyp:
+          atyp_ = c;
+          if (atyp_ == atyp_ipv4) {
+            addr_length_ = 4;
+            state_ = r_address;
+          } else if (atyp_ == atyp_ipv6) {
+            addr_length_ = 16;
+            state_ = r_address;
+          } else if (atyp_ == atyp_domain) {
+            state_ = r_domain_length;
+          } else {
+            return fail(address_not_supported);
+          }
+          break;
+        case r_domain_length:
+          if (c == 0) {
+            return fail(general_failure);
+          }
+          addr_length_ = c;
+          state_ = r_domain;
+          break;
+        case r_address:
+        case r_domain:
+          if (state_ == r_domain) {
+            domain_[addr_have_] = c;
+          } else {
+            addr_[addr_have_] = c;
+          }
+          if (++addr_have_ == addr_length_) {
+            domain_[atyp_ == atyp_domain ? addr_have_ : 0] = 0;
+            state_ = r_port;
+          }
+          break;
+        case r_port:
+          port_[port_have_++] = c;
+          if (port_have_ == 2) {
+            state_ = finished;
+            stage_ = complete;
+            return done;
+          }
+          break;
+        case finished:
+          --used;
+          return done;
+        case failed:
+          --used;
+          return error;
+      }
+    }
+
+    return state_ == failed ? error : need_more;
+  }
+
+  stage_t stage() const
+  {
+    return stage_;
+  }
+
+  // The only method offered back, everything else is refused
+  bool no_auth() const
+  {
+    return no_auth_;
+  }
+
+  uint8_t command() const
+  {
+    return command_;
+  }
+
+  uint8_t address_type() const
+  {
+    return atyp_;
+  }
+
+  // atyp_ipv4: 4 bytes, atyp_ipv6: 16 bytes, network byte order
+  const uint8_t *address() const
+  {
+    return addr_;
+  }
+
+  const char *domain_name() const
+  {
+    return domain_;
+  }
+
+  // Host byte order
+  uint16_t port() const
+  {
+    return (port_[0] << 8) | port_[1];
+  }
+
+  // REP code to send when consume() failed
+  uint8_t failure() const
+  {
+    return failure_;
+  }
+
+private:
+  enum state_t {
+    g_version, g_nmethods, g_methods,
+    r_version, r_command, r_reserved, r_atyp, r_domain_length, r_address, r_domain, r_port,
+    finished, failed
+  };
+
+  result_t fail(uint8_t reply)
+  {
+    state_ = failed;
+    failure_ = reply;
+    return error;
+  }
+
+  state_t state_;
+  stage_t stage_;
+  size_t methods_left_;
+  bool no_auth_;
+  uint8_t command_;
+  uint8_t atyp_;
+  size_t addr_length_;
+  size_t addr_have_;
+  uint8_t addr_[16];
+  char domain_[max_domain + 1];
+  uint8_t port_[2];
+  size_t port_have_;
+  uint8_t failure_;
+};
+
+#endif // SOCKS_REQUEST_PARSER_HPP
@@ -13,18 +13,45 @@
 #include <fstream>
 #include <filesystem>
 #include <memory>
+#include <new>
 #include <utility>
 #include <vector>
+#include <thread>
+#include <sstream>
+#include <atomic>
+#include <algorithm>
+#include <array>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <boost/asio.hpp>
-#include <boost/algorithm/string/classification.hpp>
-#include <boost/algorithm/string/split.hpp>
 #include <boost/asio/signal_set.hpp>
-#include <boost/algorithm/string/trim.hpp>
-#include <boost/lexical_cast.hpp>
+#include "alloc_stats.hpp"
+#include "buffer_pool.hpp"
+#include "dns_cache.hpp"
+#include "dns_client.hpp"
+#include "access_log.hpp"
+#include "admission.hpp"
+#include "firewall.hpp"
+#include "handler_memory.hpp"
+#include "handoff.hpp"
+#include "metrics.hpp"
+#include "port_allocator.hpp"
+#include "request_parser.hpp"
+#include "timer_wheel.hpp"
+#include "udp_relay.hpp"
+#ifdef SOCKS_IO_URING
+#include "uring.hpp"
+#endif
 
 #ifdef DEBUG
 #define debug_log(x) \
@@ -36,12 +63,87 @@
 #endif
 
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 using namespace std;
 
 typedef unsigned char BYTE;
 typedef unsigned short WORD;
 typedef unsigned int DWORD;
 
+struct server_config {
+  // 0: fork a process per connection, otherwise number of worker threads
+  int threads = 0;
+  string firewall_file = "./socks.conf";
+  // Relay established tunnels with splice(2) instead of user space buffers
+  bool splice = false;
+  // Buffered relay: per direction buffer limit and limit for all sessions
+  size_t relay_buffer_max = 0x40000;
+  size_t relay_memory_max = (size_t)512 << 20;
+  // Head start each resolved address gets before the next one is tried
+  std::chrono::milliseconds connect_delay = std::chrono::milliseconds(250);
+  // Session timeouts, 0 disables. Handshake ends with the request, connect
+  // covers resolving through the reply, idle is reset by relayed data.
+  std::chrono::seconds handshake_timeout = std::chrono::seconds(10);
+  std::chrono::seconds connect_timeout = std::chrono::seconds(30);
+  std::chrono::seconds idle_timeout = std::chrono::seconds(300);
+  // Thread mode: a SO_REUSEPORT listener per worker instead of one shared
+  // acceptor, workers pinned to CPUs, listeners tied to their worker's CPU
+  bool reuseport = false;
+  bool pin_cpus = false;
+  bool incoming_cpu = false;
+  // Binary upgrades: listeners are handed over on this Unix socket, the old
+  // process then gives its sessions drain_timeout to finish
+  string upgrade_socket;
+  std::chrono::seconds drain_timeout = std::chrono::seconds(30);
+  // Prometheus endpoint, disabled when the port is 0
+  string metrics_address = "127.0.0.1";
+  unsigned short metrics_port = 0;
+};
+
+static server_config g_config;
+
+// Counted for socks_heap_allocations_total
+void *operator new(std::size_t size)
+{
+  alloc_stats::allocated(size);
+
+  for (;;) {
+    if (void *p = std::malloc(size ? size : 1)) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
 struct SOCKS4_REPLY {
   BYTE vn;
   BYTE cd;
@@ -49,6 +151,92 @@ struct SOCKS4_REPLY {
   DWORD dstip;
 };
 
+// A relay direction over its bandwidth limit stops reading until the timer
+// fires. The timer is only created once a limit is actually hit.
+struct relay_pause {
+  std::unique_ptr<boost::asio::steady_timer> timer;
+  bool paused = false;
+};
+
+// Buffered relay state for one direction.
+// Two buffers let the next read run while the previous chunk is still being
+// written, and the buffer size follows the observed read sizes. Buffers are
+// borrowed from the thread's pool, an idle tunnel holds none.
+struct relay_channel {
+  enum state_t { idle, reading, filled, writing };
+
+  // Memory is only held from the moment data is ready until it's written
+  struct buffer {
+    ~buffer()
+    {
+      release();
+    }
+
+    void acquire(size_t size)
+    {
+      data = buffer_pool::local().acquire(size, capacity);
+      relay_channel::memory() += capacity;
+    }
+
+    void release()
+    {
+      if (data) {
+        buffer_pool::local().release(data, capacity);
+        relay_channel::memory() -= capacity;
+        data = NULL;
+        capacity = 0;
+      }
+    }
+
+    char *data = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    state_t state = idle;
+  };
+
+  enum { min_size = buffer_pool::min_size, max_size = buffer_pool::max_size };
+
+  // A full read means the peer has more queued, a short one means it's
+  // idling, so there is no reason to keep a big buffer around. Reads fill
+  // the buffer's whole capacity, which may be larger than size. Growth
+  // stops at the largest buffer the pool hands out.
+  void adapt(size_t length)
+  {
+    size_t limit = std::min<size_t>(g_config.relay_buffer_max, max_size);
+
+    if (length >= size && size < limit &&
+        memory() + size <= g_config.relay_memory_max) {
+      size = std::min(size * 2, limit);
+    } else if (length < size / 8 && size > min_size) {
+      size /= 2;
+    }
+  }
+
+  bool drained() const
+  {
+    return buffers[0].state == idle && buffers[1].state == idle;
+  }
+
+  static bool over_budget()
+  {
+    return memory() >= g_config.relay_memory_max;
+  }
+
+  // Bytes held by relay buffers in this process, not counting pool caches
+  static std::atomic<size_t>& memory()
+  {
+    static std::atomic<size_t> memory_(0);
+    return memory_;
+  }
+
+  buffer buffers[2];
+  int next_read = 0;
+  int next_write = 0;
+  size_t size = min_size;
+  bool eof = false;
+  relay_pause pause;
+};
+
 class session
   : public std::enable_shared_from_this<session>
 {
@@ -57,13 +245,54 @@ public:
     : io_context_(io_context),
       client_socket_(std::move(socket)),
       server_socket_(io_context),
-      resolver_(boost::asio::make_strand(io_context))
+      handshake_(new handshake(io_context)),
+      version_(0),
+      relay_wait_(0),
+      relay_refs_(0),
+      bind_port_(0),
+      rules_(firewall::current()),
+      client_ip_(0),
+      stats_(metrics::local()),
+      phase_start_(std::chrono::steady_clock::now()),
+      wheel_(timer_wheel::local(io_context)),
+      timeout_(*this),
+      last_active_(0)
+#ifdef SOCKS_IO_URING
+      ,
+      uring_(NULL),
+      uring_closed_(false),
+      uring_up_(*this),
+      uring_down_(*this)
+#endif
   {
+    metrics_add(stats_.c.accepted, 1);
+  }
+
+  ~session()
+  {
+    metrics_add(stats_.c.closed, 1);
+    open_count().fetch_sub(1, std::memory_order_relaxed);
+    if (bind_port_) {
+      port_allocator::instance().release(bind_port_);
+    }
+#ifdef __linux__
+    close_splice_pipes();
+#endif
   }
 
   void start()
   {
-    do_handle_SOCKS4_request();
+    arm_timeout(session_timeout::handshake, g_config.handshake_timeout);
+    do_read_request();
+  }
+
+  // Sessions in this process, what --max-sessions is checked against. The
+  // accept loops count a connection when they hand it out, so the ones still
+  // on their way to a worker are included; the session gives it back.
+  static std::atomic<size_t>& open_count()
+  {
+    static std::atomic<size_t> open(0);
+    return open;
   }
 
 private:
@@ -102,6 +331,15 @@ private:
     cout << endl;
   }
 
+  // Time since the previous phase ended goes to this phase's histogram
+  void end_phase(metrics::phase_t phase)
+  {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    stats_.phase[phase].record(now - phase_start_);
+    phase_start_ = now;
+  }
+
   WORD int_to_port(int port) {
     return ((port & 0xff00) >> 8) | ((port & 0xff) << 8);
   }
@@ -114,112 +352,333 @@ private:
     return sa.sin_addr.s_addr;
   }
 
-  void do_handle_SOCKS4_request()
+  void do_read_request()
   {
     auto self(shared_from_this());
-    client_socket_.async_read_some(boost::asio::buffer(data_, max_length),
+    client_socket_.async_read_some(boost::asio::buffer(handshake_->data, handshake::max_length),
       [this, self](boost::system::error_code ec, std::size_t length)
       {
-        if (!ec) {
-          BYTE vn;
-          WORD dstport;
-          DWORD dstip;
-          char *userid;
-          char *domain_name;
-          char s_port[0x8] = { 0 };
-
-          debug_log(debug_dump(data_, length););
-
-          // Parse SOCKS4_REQUEST
-          if (length < 9) {
-            debug_log(cout << "[!] Unexpected SOCKS4_REQUEST: Length error" << endl;);
-            return;
-          }
+        if (ec) {
+          return;
+        }
 
-          vn = data_[0];
+        debug_log(debug_dump(handshake_->data, length););
 
-          if (vn != 4) {
-            debug_log(cout << "[!] Unexpected SOCKS4_REQUEST: VN error" << endl;);
-            return;
-          }
+        on_request_data(length);
+      });
+  }
 
-          cd_ = data_[1];
+  // The first byte tells SOCKS4 from SOCKS5, the handshake's data holds
+  // length bytes
+  void on_request_data(size_t length)
+  {
+    if (version_ == 0) {
+      version_ = handshake_->data[0];
+    }
 
-          // Big endian
-          data_[2] ^= data_[3];
-          data_[3] ^= data_[2];
-          data_[2] ^= data_[3];
-          dstport = *((WORD *)&data_[2]);
-          dstip = *((DWORD *)&data_[4]);          
-          userid = &data_[8];
-          
-          sprintf(s_port, "%d", dstport);
+    if (version_ == 5) {
+      on_SOCKS5_data(length);
+      return;
+    }
 
-          // Recognize SOCKS4/4A
-          if ((dstip & 0x00ffffff) == 0) {
-            debug_log(cout << "[*] SOCKS4A request" << endl;);
+    size_t used = 0;
+
+    // Parse SOCKS4_REQUEST, it may take more than one read
+    switch (handshake_->parser.consume(handshake_->data, length, used)) {
+      case socks4_request_parser::need_more:
+        do_read_request();
+        return;
+      case socks4_request_parser::error:
+        debug_log(cout << "[!] Unexpected SOCKS4_REQUEST" << endl;);
+        return;
+      case socks4_request_parser::done:
+        break;
+    }
 
-            int idx = 8 + strlen(userid) + 1;
+    // Payload sent along with the request goes upstream once connected
+    handshake_->early_length = length - used;
+    memmove(handshake_->data, handshake_->data + used, handshake_->early_length);
 
-            if (idx >= (int)length) {
-              debug_log(cout << "[!] Unexpected SOCKS4A_REQUEST: USERID error" << endl;);
-              return;
-            }
+    cd_ = handshake_->parser.command();
 
-            domain_name = &data_[idx];
+    arm_timeout(session_timeout::connect, g_config.connect_timeout);
 
-            debug_log(cout << domain_name << ":" << s_port << endl;);
+    // Recognize SOCKS4/4A
+    if (handshake_->parser.socks4a()) {
+      debug_log(cout << "[*] SOCKS4A request" << endl;);
+      debug_log(cout << handshake_->parser.domain_name() << ":" << handshake_->parser.port() << endl;);
 
-            do_resolve(domain_name, s_port);
-          } else {
-            debug_log(cout << "[*] SOCKS4  request" << endl;);
+      end_phase(metrics::parse);
+      do_resolve(handshake_->parser.domain_name(), handshake_->parser.port());
+    } else {
+      debug_log(cout << "[*] SOCKS4  request" << endl;);
+
+      // The address is already on the wire, no need for the resolver
+      vector<tcp::endpoint> endpoints(1,
+        tcp::endpoint(boost::asio::ip::address_v4(ntohl(handshake_->parser.address())), handshake_->parser.port()));
+
+      debug_log(cout << endpoints.front() << endl;);
 
-            // Turn dstip from int to IP string (xxx.xxx.xxx.xxx)
-            char s_dstip[0x10] = { 0 };
+      end_phase(metrics::parse);
+      do_request(endpoints);
+    }
+  }
 
-            sprintf(s_dstip, "%d.%d.%d.%d", 
-                    (dstip) & 0xff,
-                    (dstip >> 0x8) & 0xff,
-                    (dstip >> 0x10) & 0xff,
-                    (dstip >> 0x18) & 0xff);
+  // SOCKS5: the greeting is answered first, then the request is parsed
+  // from whatever followed it
+  void on_SOCKS5_data(size_t length)
+  {
+    size_t used = 0;
+
+    switch (handshake_->parser5.consume(handshake_->data, length, used)) {
+      case socks5_request_parser::need_more:
+        do_read_request();
+        return;
+      case socks5_request_parser::error:
+        debug_log(cout << "[!] Unexpected SOCKS5 request" << endl;);
+        // A bad greeting is just closed, a bad request gets its reply
+        if (handshake_->parser5.stage() == socks5_request_parser::request) {
+          cd_ = handshake_->parser5.command();
+          do_reply(handshake_->parser5.failure());
+        }
+        return;
+      case socks5_request_parser::done:
+        break;
+    }
 
-            debug_log(cout << s_dstip << ":" << s_port << endl;);
+    length -= used;
+    memmove(handshake_->data, handshake_->data + used, length);
 
-            do_resolve(s_dstip, s_port);
-          }
+    if (handshake_->parser5.stage() == socks5_request_parser::request) {
+      do_SOCKS5_method_reply(length);
+      return;
+    }
+
+    handshake_->early_length = length;
+    cd_ = handshake_->parser5.command();
+
+    arm_timeout(session_timeout::connect, g_config.connect_timeout);
+    end_phase(metrics::parse);
+
+    if (cd_ == socks5_request_parser::udp_associate) {
+      debug_log(cout << "[*] SOCKS5 UDP ASSOCIATE" << endl;);
+      do_udp_associate();
+      return;
+    }
+
+    if (handshake_->parser5.address_type() == socks5_request_parser::atyp_domain) {
+      debug_log(cout << "[*] SOCKS5 request" << endl;);
+      debug_log(cout << handshake_->parser5.domain_name() << ":" << handshake_->parser5.port() << endl;);
+
+      do_resolve(handshake_->parser5.domain_name(), handshake_->parser5.port());
+      return;
+    }
+
+    vector<tcp::endpoint> endpoints(1, tcp::endpoint(request_address(), handshake_->parser5.port()));
+
+    debug_log(cout << "[*] SOCKS5 request" << endl;);
+    debug_log(cout << endpoints.front() << endl;);
+
+    do_request(endpoints);
+  }
+
+  // DST.ADDR of an IPv4 or IPv6 SOCKS5 request
+  boost::asio::ip::address request_address() const
+  {
+    if (handshake_->parser5.address_type() == socks5_request_parser::atyp_ipv6) {
+      boost::asio::ip::address_v6::bytes_type bytes;
+      memcpy(bytes.data(), handshake_->parser5.address(), bytes.size());
+      return boost::asio::ip::address_v6(bytes);
+    }
+
+    boost::asio::ip::address_v4::bytes_type bytes;
+    memcpy(bytes.data(), handshake_->parser5.address(), bytes.size());
+    return boost::asio::ip::address_v4(bytes);
+  }
+
+  // Only "no authentication" is offered, a client without it is refused
+  // and closed. pending bytes already read belong to the request.
+  void do_SOCKS5_method_reply(size_t pending)
+  {
+    auto self(shared_from_this());
+    bool ok = handshake_->parser5.no_auth();
+    BYTE *reply = handshake_->reply[handshake_->replies++ % 2];
+
+    reply[0] = 5;
+    reply[1] = ok ? socks5_request_parser::method_no_auth : socks5_request_parser::method_none;
+
+    boost::asio::async_write(client_socket_, boost::asio::buffer(reply, 2),
+      [this, self, ok, pending](boost::system::error_code ec, std::size_t /*length*/)
+      {
+        if (ec || !ok) {
+          debug_log(cout << "[!] SOCKS5 method negotiation failed" << endl;);
+          return;
+        }
+
+        if (pending) {
+          on_request_data(pending);
+        } else {
+          do_read_request();
         }
       });
   }
 
-  void do_bind()
+  // server_socket_ is connected: send the early payload and relay once
+  // both it and the final reply are out
+  void do_server_ready()
   {
     auto self(shared_from_this());
 
-    int port = 0x5566;
-    DWORD proxy_ip;
+    relay_wait_ = 1;
+    lookup_limits();
 
-    reply_cnt_ = 0;
+    if (handshake_->early_length == 0) {
+      return;
+    }
 
-    proxy_ip = ip_to_dword(client_socket_.local_endpoint().address().to_string());
+    ++relay_wait_;
 
-    while (true) {
-      try 
+    boost::asio::async_write(server_socket_, boost::asio::buffer(handshake_->data, handshake_->early_length),
+      [this, self](boost::system::error_code ec, std::size_t length)
       {
-        p_acceptor_ = new tcp::acceptor(io_context_, tcp::endpoint(tcp::v4(), port));
-        break;
-      } 
-      catch (std::exception& e)
+        metrics_add(stats_.c.bytes_upstream, length);
+
+        if (ec) {
+          debug_log(cout << "[!] Early data write failed (" << server_endpoint_ << ")" << endl;);
+          close_tunnel();
+          return;
+        }
+        do_relay_ready();
+      });
+  }
+
+  void lookup_limits()
+  {
+    const rate_limits& limits = rules_->limits();
+
+    if (limits.empty()) {
+      return;
+    }
+
+    boost::system::error_code ec;
+    tcp::endpoint client = client_socket_.remote_endpoint(ec);
+    uint32_t client_ip = !ec && client.address().is_v4() ? client.address().to_v4().to_uint() : 0;
+    // An association has no single destination
+    bool dest_v4 = cd_ != socks5_request_parser::udp_associate && server_endpoint_.address().is_v4();
+
+    limits.lookup(client_ip, handshake_->parser.user_id(), dest_v4,
+                  dest_v4 ? server_endpoint_.address().to_v4().to_uint() : 0, buckets_);
+  }
+
+  // Charges relayed bytes, resume runs once the buckets allow more
+  template <typename Resume>
+  void throttle(relay_pause& pause, size_t length, Resume resume)
+  {
+    if (buckets_.empty()) {
+      return;
+    }
+
+    std::chrono::nanoseconds delay = rate_limits::charge(buckets_, length);
+
+    if (delay.count() == 0) {
+      return;
+    }
+
+    relay_ref self(*this);
+
+    if (!pause.timer) {
+      pause.timer.reset(new boost::asio::steady_timer(io_context_));
+    }
+    pause.paused = true;
+    pause.timer->expires_after(delay);
+    pause.timer->async_wait(recycle(
+      [self, &pause, resume](boost::system::error_code ec)
       {
-        port += 1;
+        pause.paused = false;
+        if (!ec) {
+          resume();
+        }
+      }));
+  }
+
+  void do_relay_ready()
+  {
+    if (--relay_wait_ == 0) {
+      start_relay();
+    }
+  }
+
+  // Listen on a port from the BIND range, 0 when none could be bound
+  WORD open_bind_acceptor()
+  {
+    port_allocator& allocator = port_allocator::instance();
+    auto started = std::chrono::steady_clock::now();
+
+    for (size_t tries = 0; tries < allocator.size(); ++tries) {
+      boost::system::error_code ec;
+      WORD port = allocator.allocate();
+
+      if (port == 0) {
+        return 0;
+      }
+
+      std::unique_ptr<tcp::acceptor> acceptor(new tcp::acceptor(io_context_));
+      tcp::endpoint endpoint(tcp::v4(), port);
+
+      acceptor->open(endpoint.protocol(), ec);
+      if (!ec) {
+        acceptor->set_option(tcp::acceptor::reuse_address(true), ec);
       }
+      if (!ec) {
+        acceptor->bind(endpoint, ec);
+      }
+      if (!ec) {
+        acceptor->listen(boost::asio::socket_base::max_listen_connections, ec);
+      }
+
+      if (ec) {
+        allocator.release_busy(port);
+        continue;
+      }
+
+      allocator.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - started).count());
+      handshake_->bind_acceptor = std::move(acceptor);
+      bind_port_ = port;
+      return port;
+    }
+
+    return 0;
+  }
+
+  void do_bind()
+  {
+    auto self(shared_from_this());
+
+    int port;
+
+    handshake_->reply_cnt = 0;
+
+    port = open_bind_acceptor();
+
+    if (port == 0) {
+      debug_log(cout << "[!] BIND - No port available" << endl;);
+      do_reply(socks5_request_parser::general_failure);
+      return;
     }
 
+    tcp::endpoint bound(client_socket_.local_endpoint().address(), port);
+
     // Reply client which port to use
-    do_SOCKS4_reply(1, int_to_port(port), proxy_ip);
+    do_reply(socks5_request_parser::succeeded, bound);
 
-    p_acceptor_->async_accept(
-      [this, self, port, proxy_ip](boost::system::error_code ec, tcp::socket socket)
+    handshake_->bind_acceptor->async_accept(
+      [this, self, bound](boost::system::error_code ec, tcp::socket socket)
       {
+        // One connection is all BIND takes
+        boost::system::error_code ignored;
+        handshake_->bind_acceptor->close(ignored);
+
         if (!ec) {
           // Verify the incoming end point is what it should be
           if (server_endpoint_.address().to_string() != socket.remote_endpoint().address().to_string()) {
@@ -230,367 +689,2295 @@ private:
           debug_log(cout << "[O] BIND - Server connected (" << server_endpoint_ << ")" << endl;);
           
           server_socket_ = tcp::socket(std::move(socket));
+          end_phase(metrics::connect);
+          do_server_ready();
 
           // Ok, send reply to client
-          // Start proxing data from server to client
-          do_SOCKS4_reply(1, int_to_port(port), proxy_ip);
+          // Start proxing data from server to client. SOCKS5 names the
+          // host that connected, SOCKS4 repeats the port.
+          boost::system::error_code ignored_ec;
+          do_reply(socks5_request_parser::succeeded,
+                   version_ == 5 ? server_socket_.remote_endpoint(ignored_ec) : bound);
         } else {
           debug_log(cout << "[x] BIND Accept error: " << ec << endl;);
         }
       });
   }
 
-  int firewall()
-  {
-    // Read socks.conf
-    string filename = "./socks.conf";
-    ifstream firewallfile(filename);
-
-    if (firewallfile.fail()) {
-      cerr << "[x] socks.conf doesn't exist" << endl;
-      cerr << "[*] socks.conf example:" << endl;
-      cerr << R""""(
-              # Allow comment
-              #
-              # format:
-              #   permit <command> <IPv4>
-              # command:
-              #   c: CONNECT
-              #   b: BIND
-              
-              # permit c 140.113.*.*
-              permit c *.*.*.*
-              permit b *.*.*.*
-              )"""" << endl;
+  int firewall(const tcp::endpoint& endpoint)
+  {
+    if (!endpoint.address().is_v4()) {
       return -1;
     }
 
-    if (firewallfile.is_open()) {
-      string line;
-      while (getline(firewallfile, line)) {
-        vector<string> params;
-        vector<string> ips;
-        int command = 0;
-        int ip[4];
-        int dstip[4];
-
-        if (line[0] == '#') {
-          continue;
-        }
-
-        boost::algorithm::trim(line);
-
-        if (line.length() == 0) {
-          continue;
-        }
-
-        // permit <command> <ipv4>
-        // e.g.
-        //   permit c 140.130.*.*
-        
-        // Parse rule
-        // "ACTION COMMAND IP"
-        boost::split(params, line, boost::is_any_of(" "), boost::token_compress_on);
-        
-        if (params.size() != 3) {
-          cerr << "[*] socks.conf rule parse error:" << line << endl;
-          return -1;
-        }
-
-        if (params[0] != "permit") {
-          cerr << "[*] socks.conf rule parse error:" << line << endl;
-          return -1;
-        }
-
-        if (params[1].length() != 1) {
-          cerr << "[*] socks.conf rule parse error:" << line << endl;
-          return -1;
-        }
-
-        switch (params[1][0]) {
-          case 'c':
-            command = 1;
-            break;
-          case 'b':
-            command = 2;
-            break;
-          default:
-            cerr << "[*] socks.conf rule parse error:" << line << endl;
-            return -1;
-        }
-
-        // Parse IPv4
-        // "<number/*>.<number/*>.<number/*>.<number/*>"
-        boost::split(ips, params[2], boost::is_any_of("."), boost::token_compress_on);
-
-        if (ips.size() != 4) {
-          cerr << "[*] socks.conf rule parse error:" << line << endl;
-          return -1;
-        }
+    if (!permit(cd_, endpoint.address().to_v4().to_uint(), endpoint.port())) {
+      return -1;
+    }
 
-        // Check COMMAND
-        if (cd_ != command) {
-          continue;
-        }
+    return 0;
+  }
 
-        for (int i = 0; i < 4; ++i) {
-          try 
-          {
-            ip[i] = boost::lexical_cast<int>(ips[i]);
-            if (ip[i] < 0 || ip[i] > 255) {
-              cerr << "[*] socks.conf rule parse error:" << line << endl;
-              return -1;
-            }
-          } 
-          catch (std::exception& e) 
-          {
-            if (ips[i].length() == 1 && ips[i][0] == '*') {
-              ip[i] = -1;
-            }
-          }
-        }
+  bool permit(uint8_t command, uint32_t addr, WORD port) const
+  {
+    firewall_request r;
+    bool hit;
 
-        boost::split(ips, server_endpoint_.address().to_string(), boost::is_any_of("."), boost::token_compress_on);
+    r.command = command;
+    r.addr = addr;
+    r.port = port;
+    r.client = rules_->uses_client() ? client_ip() : 0;
+    // Only datagrams are checked after the handshake, SOCKS5 has no USERID
+    r.user = handshake_ ? handshake_->parser.user_id() : "";
 
-        for (int i = 0; i < 4; ++i) {
-          dstip[i] = boost::lexical_cast<int>(ips[i]);
-        }
+    bool allowed = rules_->permit(r, hit);
 
-        // Check dst IP
-        int check = 0;
-        for (; check < 4; ++check) {
-          if (ip[check] == -1) {
-            continue;
-          }
-          if (ip[check] == dstip[check]) {
-            continue;
-          }
+    if (rules_->cacheable()) {
+      metrics_add(hit ? stats_.c.firewall_cache_hits : stats_.c.firewall_cache_misses, 1);
+    }
+    return allowed;
+  }
 
-          break;
-        }
+  // Looked up once, datagrams are checked against it too
+  uint32_t client_ip() const
+  {
+    if (client_ip_ == 0) {
+      boost::system::error_code ec;
+      tcp::endpoint client = client_socket_.remote_endpoint(ec);
 
-        if (check == 4) {
-          // Accept
-          return 0;
-        }
+      if (!ec && client.address().is_v4()) {
+        client_ip_ = client.address().to_v4().to_uint();
       }
-      firewallfile.close();
     }
-
-    // Default policy: reject
-    return -1;
+    return client_ip_;
   }
 
-  void do_resolve(string hostname, string port)
+  void do_resolve(string hostname, WORD port)
   {
     auto self(shared_from_this());
-    resolver_.async_resolve(
-      string(hostname),
-      string(port),
-      [this, self](boost::system::error_code ec, tcp::resolver::results_type endpoints)
+    dns_cache::instance().resolve(
+      hostname,
+      io_context_,
+      [this, self, port](const boost::system::error_code& ec, const dns_cache::addresses& addresses)
       {
-        if (!ec) {
-          for (auto it = endpoints.cbegin(); it != endpoints.cend(); it++) {
-            server_endpoint_ = *it;
-            break;
-          }
+        end_phase(metrics::resolve);
 
-          debug_log(cout << "[O] Resolve OK (" << server_endpoint_ << ")" << endl;);
+        if (!ec) {
+          vector<tcp::endpoint> endpoints;
 
-          // Check firewall
-          int ok = firewall();
-          
-          if (ok == -1) {
-            // Rejected
-            debug_log(cout << "[!] Firewall rejected (" << server_endpoint_ << ")" << endl;);
-            do_SOCKS4_reply(0, 0, 0);
-            return;
+          for (const boost::asio::ip::address& address : addresses) {
+            endpoints.push_back(tcp::endpoint(address, port));
           }
 
-          if (cd_ == 1) {
-            // CONNECT
-            do_connect();
-          } else if (cd_ == 2) {
-            // BIND
-            do_bind();
-          }
+          debug_log(cout << "[O] Resolve OK (" << endpoints.size() << " addresses)" << endl;);
+
+          do_request(endpoints);
         } else {
           debug_log(cout << "[!] Resolve failed" << endl;);
-          do_SOCKS4_reply(0, 0, 0);
+          metrics_add(stats_.c.resolve_failures, 1);
+          do_reply(socks5_request_parser::host_unreachable);
         }
       });
   }
 
-  void do_connect()
+  // Every candidate address goes through the firewall, the command then
+  // runs against the ones that are permitted
+  void do_request(const vector<tcp::endpoint>& endpoints)
   {
-    auto self(shared_from_this());
-    server_socket_.async_connect(
-      server_endpoint_,
-      [this, self](boost::system::error_code ec)
-      {
-        if (!ec) {
-          debug_log(cout << "[O] Connect OK (" << server_endpoint_ << ")" << endl;);
-          do_SOCKS4_reply(1, 0, 0);
-        } else {
-          debug_log(cout << "[!] Connect failed (" << server_endpoint_ << ")" << endl;);
-          do_SOCKS4_reply(0, 0, 0);
-        }
-      });
-  }
+    // Timed out while resolving
+    if (!client_socket_.is_open()) {
+      return;
+    }
 
-  void do_SOCKS4_reply(int ok, WORD dstport, DWORD dstip) {
-    auto self(shared_from_this());
+    server_endpoint_ = endpoints.front();
+    handshake_->connect_endpoints.clear();
 
-    SOCKS4_REPLY reply;
+    for (const tcp::endpoint& endpoint : endpoints) {
+      if (firewall(endpoint) == 0) {
+        handshake_->connect_endpoints.push_back(endpoint);
+      } else {
+        debug_log(cout << "[!] Firewall rejected (" << endpoint << ")" << endl;);
+      }
+    }
 
-    reply.vn = 0;
-    reply.cd = ok ? 90 : 91;
-    reply.dstport = dstport;
-    reply.dstip = dstip;
+    end_phase(metrics::firewall);
+
+    if (handshake_->connect_endpoints.empty()) {
+      // Rejected
+      metrics_add(stats_.c.rejected, 1);
+      do_reply(socks5_request_parser::not_allowed);
+      return;
+    }
+
+    server_endpoint_ = handshake_->connect_endpoints.front();
 
-    // Log
-    cout << "<S_IP>: " << client_socket_.remote_endpoint().address().to_string() << endl;
-    cout << "<S_PORT>: " << client_socket_.remote_endpoint().port() << endl;
-    cout << "<D_IP>: " << server_endpoint_.address().to_string() << endl;
-    cout << "<D_PORT>: " << server_endpoint_.port() << endl;
     if (cd_ == 1) {
-      cout << "<Command>: CONNECT" << endl;
+      // CONNECT
+      do_connect();
     } else if (cd_ == 2) {
-      cout << "<Command>: BIND" << endl;
-    }
-    if (ok) {
-      cout << "<Reply>: Accept" << endl;
+      // BIND
+      do_bind();
     } else {
-      cout << "<Reply>: Reject" << endl;
+      do_reply(socks5_request_parser::command_not_supported);
     }
+  }
 
-    debug_log(debug_dump((char *)&reply, sizeof(reply)););
+  // Happy eyeballs: a new attempt starts every connect_delay, or right away
+  // when the previous one fails. The first connection wins, the rest are
+  // closed.
+  struct connect_attempt {
+    connect_attempt(boost::asio::io_context& io_context, const tcp::endpoint& endpoint)
+      : socket(io_context),
+        endpoint(endpoint),
+        started(std::chrono::steady_clock::now())
+    {
+    }
 
-    boost::asio::async_write(client_socket_, boost::asio::buffer((char *)&reply, sizeof(reply)),
-      [this, self, ok](boost::system::error_code ec, std::size_t /*length*/) {
-        if (!ec) {
-          debug_log(cout << "[O] Reply OK (" << server_endpoint_ << ")" << endl;);
-          
-          if (ok) {
-            if (cd_ == 1) {
-              // CONNECT
-              do_client_read();
-              do_server_read();
-            } else if (cd_ == 2) {
-              // BIND
-              ++reply_cnt_;
+    tcp::socket socket;
+    tcp::endpoint endpoint;
+    std::chrono::steady_clock::time_point started;
+  };
+
+  // State that only matters until the tunnel is up: the request as read
+  // and parsed, the replies, connect attempts and the BIND listener. It's
+  // freed when relaying starts, an idle tunnel doesn't carry it.
+  struct handshake {
+    enum { max_length = 1024 };
+
+    explicit handshake(boost::asio::io_context& io_context)
+      : early_length(0),
+        reply_cnt(0),
+        replies(0),
+        connect_timer(io_context),
+        pending_attempts(0),
+        connected(false)
+    {
+    }
 
-              if (reply_cnt_ == 2) {
-                do_client_read();
-                do_server_read();
+    char data[max_length];
+    size_t early_length;  // Payload that came with the request
+    socks4_request_parser parser;
+    socks5_request_parser parser5;
+    BYTE reply_cnt;
+    BYTE reply[2][socks5_udp_header::max_prepend];
+    int replies;
+    vector<tcp::endpoint> connect_endpoints;
+    vector<std::unique_ptr<connect_attempt>> attempts;
+    boost::asio::steady_timer connect_timer;
+    int pending_attempts;
+    bool connected;
+    boost::system::error_code connect_error;
+    std::unique_ptr<tcp::acceptor> bind_acceptor;
+  };
+
+  void do_connect()
+  {
+    handshake& h = *handshake_;
+
+    h.connected = false;
+    h.pending_attempts = 0;
+    h.attempts.clear();
+    do_connect_attempt();
+  }
+
+  void do_connect_attempt()
+  {
+    auto self(shared_from_this());
+    handshake& h = *handshake_;
+    size_t idx = h.attempts.size();
+
+    h.attempts.emplace_back(new connect_attempt(io_context_, h.connect_endpoints[idx]));
+    ++h.pending_attempts;
+
+    debug_log(cout << "[*] Connect attempt " << idx << " (" << h.connect_endpoints[idx] << ")" << endl;);
+
+    h.attempts[idx]->socket.async_connect(
+      h.connect_endpoints[idx],
+      [this, self, idx](boost::system::error_code ec)
+      {
+        // A loser finishing after the tunnel is up, its socket went with
+        // the handshake
+        if (!handshake_) {
+          return;
+        }
+
+        handshake& h = *handshake_;
+        connect_attempt& attempt = *h.attempts[idx];
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - attempt.started);
+
+        stats_.connect_attempt.record(elapsed);
+        --h.pending_attempts;
+
+        if (h.connected || !client_socket_.is_open()) {
+          return;
+        }
+
+        if (!ec) {
+          debug_log(cout << "[O] Connect OK (" << attempt.endpoint << ", " << elapsed.count() << " us)" << endl;);
+          h.connected = true;
+          h.connect_timer.cancel();
+          server_socket_ = std::move(attempt.socket);
+          server_endpoint_ = attempt.endpoint;
+          for (auto& other : h.attempts) {
+            boost::system::error_code ignored;
+            other->socket.close(ignored);
+          }
+          end_phase(metrics::connect);
+          do_server_ready();
+          do_reply(socks5_request_parser::succeeded, server_socket_.local_endpoint(ec));
+          return;
+        }
+
+        debug_log(cout << "[!] Connect failed (" << attempt.endpoint << ", " << elapsed.count() << " us)" << endl;);
+        h.connect_error = ec;
+
+        if (h.attempts.size() < h.connect_endpoints.size()) {
+          h.connect_timer.cancel();
+          do_connect_attempt();
+        } else if (h.pending_attempts == 0) {
+          metrics_add(stats_.c.connect_failures, 1);
+          do_reply(connect_failure());
+        }
+      });
+
+    if (idx + 1 < h.connect_endpoints.size()) {
+      h.connect_timer.expires_after(g_config.connect_delay);
+      h.connect_timer.async_wait(
+        [this, self, idx](boost::system::error_code ec)
+        {
+          // Cancelled, or the next attempt already started after a failure
+          if (ec || !handshake_ || handshake_->connected || handshake_->attempts.size() != idx + 1 ||
+              !client_socket_.is_open()) {
+            return;
+          }
+          do_connect_attempt();
+        });
+    }
+  }
+
+  // REP for a CONNECT where every attempt failed, from the last error
+  BYTE connect_failure() const
+  {
+    if (handshake_->connect_error == boost::asio::error::connection_refused) {
+      return socks5_request_parser::connection_refused;
+    } else if (handshake_->connect_error == boost::asio::error::network_unreachable) {
+      return socks5_request_parser::network_unreachable;
+    } else if (handshake_->connect_error == boost::asio::error::host_unreachable ||
+               handshake_->connect_error == boost::asio::error::timed_out) {
+      return socks5_request_parser::host_unreachable;
+    }
+    return socks5_request_parser::general_failure;
+  }
+
+  // Replies in the client's protocol. rep is a SOCKS5 REP code, SOCKS4 only
+  // tells granted from rejected. bound is BND.ADDR and BND.PORT, SOCKS4 only
+  // sends it for BIND.
+  void do_reply(BYTE rep, const tcp::endpoint& bound = tcp::endpoint())
+  {
+    auto self(shared_from_this());
+    bool ok = rep == socks5_request_parser::succeeded;
+
+    // The reply has to outlive the write, BIND may have two in flight
+    BYTE *reply = handshake_->reply[handshake_->replies++ % 2];
+    size_t length;
+
+    if (version_ == 5) {
+      length = 4;
+      reply[0] = 5;
+      reply[1] = rep;
+      reply[2] = 0;
+      if (bound.address().is_v6()) {
+        boost::asio::ip::address_v6::bytes_type addr = bound.address().to_v6().to_bytes();
+        reply[3] = socks5_request_parser::atyp_ipv6;
+        memcpy(reply + length, addr.data(), addr.size());
+        length += addr.size();
+      } else {
+        boost::asio::ip::address_v4::bytes_type addr = bound.address().to_v4().to_bytes();
+        reply[3] = socks5_request_parser::atyp_ipv4;
+        memcpy(reply + length, addr.data(), addr.size());
+        length += addr.size();
+      }
+      reply[length++] = bound.port() >> 8;
+      reply[length++] = bound.port() & 0xff;
+    } else {
+      SOCKS4_REPLY socks4;
+      bool bind = ok && cd_ == 2 && bound.address().is_v4();
+
+      socks4.vn = 0;
+      socks4.cd = ok ? 90 : 91;
+      socks4.dstport = bind ? int_to_port(bound.port()) : 0;
+      socks4.dstip = bind ? htonl(bound.address().to_v4().to_uint()) : 0;
+      memcpy(reply, &socks4, sizeof(socks4));
+      length = sizeof(socks4);
+    }
+
+    // Log
+    if (access_log::instance().enabled()) {
+      access_record record;
+      boost::system::error_code ec;
+      tcp::endpoint client = client_socket_.remote_endpoint(ec);
+
+      memset(&record, 0, sizeof(record));
+      record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+      if (!ec && client.address().is_v4()) {
+        boost::asio::ip::address_v4::bytes_type src = client.address().to_v4().to_bytes();
+        memcpy(record.src_ip, src.data(), src.size());
+        record.src_port = client.port();
+      }
+      if (server_endpoint_.address().is_v6()) {
+        boost::asio::ip::address_v6::bytes_type dst = server_endpoint_.address().to_v6().to_bytes();
+        memcpy(record.dst_ip, dst.data(), dst.size());
+        record.dst_v6 = 1;
+      } else {
+        boost::asio::ip::address_v4::bytes_type dst = server_endpoint_.address().to_v4().to_bytes();
+        memcpy(record.dst_ip, dst.data(), dst.size());
+      }
+      record.dst_port = server_endpoint_.port();
+      record.command = cd_;
+      record.accepted = ok ? 1 : 0;
+
+      access_log::instance().log(record);
+    }
+
+    debug_log(debug_dump((char *)reply, length););
+
+    boost::asio::async_write(client_socket_, boost::asio::buffer(reply, length),
+      [this, self, ok](boost::system::error_code ec, std::size_t /*length*/) {
+        if (!ec) {
+          debug_log(cout << "[O] Reply OK (" << server_endpoint_ << ")" << endl;);
+          
+          if (ok) {
+            if (cd_ == 1) {
+              // CONNECT
+              end_phase(metrics::reply);
+              do_relay_ready();
+            } else if (cd_ == 2) {
+              // BIND
+              ++handshake_->reply_cnt;
+
+              if (handshake_->reply_cnt == 2) {
+                end_phase(metrics::reply);
+                do_relay_ready();
               }
+            } else if (cd_ == 3) {
+              // UDP ASSOCIATE
+              end_phase(metrics::reply);
+              start_udp_relay();
             }
           }
         } else {
           debug_log(cout << "[!] Reply failed (" << server_endpoint_ << ")" << endl;);
         }
-      });
+      });
+  }
+
+  // The relay's hold on the session. Its handlers share one shared_ptr,
+  // taken with the first of them and dropped with the last, so passing a
+  // handler on only moves a pointer. The count is a plain int, all
+  // handlers of a session run on its thread.
+  class relay_ref
+  {
+  public:
+    relay_ref()
+      : owner_(NULL)
+    {
+    }
+
+    explicit relay_ref(session& s)
+      : owner_(&s)
+    {
+      if (s.relay_refs_++ == 0) {
+        s.relay_self_ = s.shared_from_this();
+      }
+    }
+
+    relay_ref(const relay_ref& other)
+      : owner_(other.owner_)
+    {
+      if (owner_) {
+        ++owner_->relay_refs_;
+      }
+    }
+
+    relay_ref(relay_ref&& other)
+      : owner_(other.owner_)
+    {
+      other.owner_ = NULL;
+    }
+
+    relay_ref& operator=(relay_ref other)
+    {
+      std::swap(owner_, other.owner_);
+      return *this;
+    }
+
+    ~relay_ref()
+    {
+      if (owner_ && --owner_->relay_refs_ == 0) {
+        // May be the end of the session, the member is emptied first
+        std::shared_ptr<session> last;
+        last.swap(owner_->relay_self_);
+      }
+    }
+
+  private:
+    session *owner_;
+  };
+
+  void start_relay()
+  {
+    handshake_.reset();
+    last_active_ = wheel_.now();
+    arm_timeout(session_timeout::idle, g_config.idle_timeout);
+
+#ifdef __linux__
+    if (g_config.splice && start_splice_relay()) {
+      return;
+    }
+#endif
+#ifdef SOCKS_IO_URING
+    if (g_config.threads && start_uring_relay()) {
+      return;
+    }
+#endif
+    client_socket_.non_blocking(true);
+    server_socket_.non_blocking(true);
+    do_client_read();
+    do_server_read();
+  }
+
+  void do_client_read()
+  {
+    do_relay_read(client_socket_, server_socket_, client_relay_);
+  }
+
+  void do_server_read()
+  {
+    do_relay_read(server_socket_, client_socket_, server_relay_);
+  }
+
+  void do_relay_read(tcp::socket& src, tcp::socket& dst, relay_channel& ch)
+  {
+    relay_ref self(*this);
+    int idx = ch.next_read;
+    relay_channel::buffer& buf = ch.buffers[idx];
+
+    if (ch.eof || ch.pause.paused || buf.state != relay_channel::idle) {
+      return;
+    }
+
+    // Read ahead while the other buffer is written, unless memory is tight
+    if (ch.buffers[1 - idx].state != relay_channel::idle && relay_channel::over_budget()) {
+      return;
+    }
+
+    buf.state = relay_channel::reading;
+
+    // Wait for data first so no buffer is tied up by a silent peer
+    src.async_wait(tcp::socket::wait_read, recycle(
+      [this, self, &src, &dst, &ch, idx](boost::system::error_code ec)
+      {
+        relay_channel::buffer& buf = ch.buffers[idx];
+        std::size_t length = 0;
+
+        if (!ec) {
+          buf.acquire(ch.size);
+          length = src.read_some(boost::asio::buffer(buf.data, buf.capacity), ec);
+
+          if (ec == boost::asio::error::would_block) {
+            buf.release();
+            buf.state = relay_channel::idle;
+            do_relay_read(src, dst, ch);
+            return;
+          }
+        }
+
+        if (!ec) {
+          debug_log(debug_dump(buf.data, length););
+          last_active_ = wheel_.now();
+          buf.length = length;
+          buf.state = relay_channel::filled;
+          ch.next_read = 1 - idx;
+          ch.adapt(length);
+          throttle(ch.pause, length, [this, &src, &dst, &ch]() { do_relay_read(src, dst, ch); });
+          do_relay_write(src, dst, ch);
+          do_relay_read(src, dst, ch);
+        } else {
+          debug_log(cout << "[!] Read failed (" << server_endpoint_ << ")" << endl;);
+          buf.release();
+          buf.state = relay_channel::idle;
+          ch.eof = true;
+          // Whatever is still buffered gets written before dst is closed
+          if (ch.drained()) {
+            dst.close();
+          }
+        }
+      }));
+  }
+
+  void do_relay_write(tcp::socket& src, tcp::socket& dst, relay_channel& ch)
+  {
+    relay_ref self(*this);
+    int idx = ch.next_write;
+    relay_channel::buffer& buf = ch.buffers[idx];
+
+    if (buf.state != relay_channel::filled) {
+      return;
+    }
+
+    buf.state = relay_channel::writing;
+
+    boost::asio::async_write(dst, boost::asio::buffer(buf.data, buf.length), recycle(
+      [this, self, &src, &dst, &ch, idx](boost::system::error_code ec, std::size_t length) {
+        metrics_add(&ch == &client_relay_ ? stats_.c.bytes_upstream : stats_.c.bytes_downstream, length);
+        ch.buffers[idx].release();
+        ch.buffers[idx].state = relay_channel::idle;
+        ch.next_write = 1 - idx;
+
+        if (ec) {
+          debug_log(cout << "[!] Write failed (" << server_endpoint_ << ")" << endl;);
+          close_tunnel();
+          return;
+        }
+
+        debug_log(cout << "[O] Write OK (" << server_endpoint_ << ")" << endl;);
+
+        if (ch.eof && ch.drained()) {
+          dst.close();
+          return;
+        }
+
+        do_relay_write(src, dst, ch);
+        do_relay_read(src, dst, ch);
+      }));
+  }
+
+  // Handshake and connect timeouts close the session outright. The idle
+  // timeout is not moved on every read: when it fires it checks the last
+  // activity and re-arms for the remainder if there was any.
+  struct session_timeout
+    : timer_wheel::entry
+  {
+    enum kind_t { handshake, connect, idle };
+
+    explicit session_timeout(session& s)
+      : owner(s),
+        kind(handshake)
+    {
+    }
+
+    void expired() override
+    {
+      owner.on_timeout();
+    }
+
+    session& owner;
+    kind_t kind;
+  };
+
+  void arm_timeout(session_timeout::kind_t kind, std::chrono::seconds after)
+  {
+    timeout_.kind = kind;
+    if (after.count() == 0) {
+      timeout_.cancel();
+      return;
+    }
+    wheel_.schedule(timeout_, after);
+  }
+
+  void on_timeout()
+  {
+    switch (timeout_.kind) {
+      case session_timeout::handshake:
+        debug_log(cout << "[!] Handshake timeout" << endl;);
+        metrics_add(stats_.c.handshake_timeouts, 1);
+        break;
+      case session_timeout::connect:
+        debug_log(cout << "[!] Connect timeout (" << server_endpoint_ << ")" << endl;);
+        metrics_add(stats_.c.connect_timeouts, 1);
+        break;
+      case session_timeout::idle: {
+        timer_wheel::clock::duration quiet = timer_wheel::resolution() * (wheel_.now() - last_active_);
+
+        if (quiet < g_config.idle_timeout) {
+          wheel_.schedule(timeout_, g_config.idle_timeout - quiet);
+          return;
+        }
+        debug_log(cout << "[!] Idle timeout (" << server_endpoint_ << ")" << endl;);
+        metrics_add(stats_.c.idle_timeouts, 1);
+        break;
+      }
+    }
+
+    // Everything pending gets aborted and releases the session
+    if (handshake_) {
+      boost::system::error_code ec;
+      handshake_->connect_timer.cancel();
+      for (auto& attempt : handshake_->attempts) {
+        attempt->socket.close(ec);
+      }
+      if (handshake_->bind_acceptor) {
+        handshake_->bind_acceptor->close(ec);
+      }
+    }
+    close_tunnel();
+  }
+
+  // Either direction ending tears down both, the pending waits then abort
+  void close_tunnel()
+  {
+    boost::system::error_code ec;
+
+#ifdef SOCKS_IO_URING
+    // The ring still holds the sockets, they're closed with the session
+    if (uring_) {
+      close_uring();
+    } else
+#endif
+    {
+      client_socket_.close(ec);
+      server_socket_.close(ec);
+    }
+
+    for (relay_pause *pause : { &client_relay_.pause, &server_relay_.pause }) {
+      if (pause->timer) {
+        pause->timer->cancel();
+      }
+    }
+#ifdef __linux__
+    for (relay_pause *pause : { &upstream_.pause, &downstream_.pause }) {
+      if (pause->timer) {
+        pause->timer->cancel();
+      }
+    }
+#endif
+    if (udp_) {
+      udp_->socket.close(ec);
+      if (udp_->pause.timer) {
+        udp_->pause.timer->cancel();
+      }
+    }
+  }
+
+  // SOCKS5 UDP ASSOCIATE: one socket faces the client and every destination,
+  // the TCP connection only keeps the association alive. Each wakeup reads
+  // and relays datagrams in batches, see udp_relay.hpp.
+  struct udp_association {
+    explicit udp_association(boost::asio::io_context& io_context)
+      : socket(io_context)
+    {
+    }
+
+    udp::socket socket;
+    udp::endpoint client;  // Port 0 until the first datagram says otherwise
+    udp_batch batch;
+    relay_pause pause;
+  };
+
+  enum { udp_rounds = 4 };
+
+  void do_udp_associate()
+  {
+    boost::system::error_code ec;
+    tcp::endpoint local = client_socket_.local_endpoint(ec);
+    tcp::endpoint peer = client_socket_.remote_endpoint(ec);
+    boost::asio::ip::address client = peer.address();
+
+    // DST.ADDR is where the client will send from, zero if it doesn't know
+    if (handshake_->parser5.address_type() != socks5_request_parser::atyp_domain &&
+        !request_address().is_unspecified()) {
+      client = request_address();
+    }
+
+    udp_.reset(new udp_association(io_context_));
+    udp_->client = udp::endpoint(client, handshake_->parser5.port());
+    server_endpoint_ = tcp::endpoint(client, handshake_->parser5.port());
+
+    if (!ec) {
+      udp_->socket.open(local.address().is_v4() ? udp::v4() : udp::v6(), ec);
+    }
+    if (!ec) {
+      udp_->socket.bind(udp::endpoint(local.address(), 0), ec);
+    }
+
+    udp::endpoint bound = udp_->socket.local_endpoint(ec);
+
+    if (ec) {
+      debug_log(cout << "[!] UDP ASSOCIATE - No socket (" << ec.message() << ")" << endl;);
+      do_reply(socks5_request_parser::general_failure);
+      return;
+    }
+
+    end_phase(metrics::connect);
+    do_reply(socks5_request_parser::succeeded, tcp::endpoint(bound.address(), bound.port()));
+  }
+
+  void start_udp_relay()
+  {
+    boost::system::error_code ec;
+
+    last_active_ = wheel_.now();
+    arm_timeout(session_timeout::idle, g_config.idle_timeout);
+    lookup_limits();
+    handshake_.reset();
+    client_socket_.non_blocking(true, ec);
+    do_udp_read();
+    do_control_read();
+  }
+
+  // Nothing more is expected from the client over TCP, its close ends the
+  // association. Anything it does send is read once ready and dropped, so
+  // no buffer is held meanwhile.
+  void do_control_read()
+  {
+    relay_ref self(*this);
+    client_socket_.async_wait(tcp::socket::wait_read, recycle(
+      [this, self](boost::system::error_code ec)
+      {
+        char discard[256];
+
+        if (!ec) {
+          client_socket_.read_some(boost::asio::buffer(discard, sizeof(discard)), ec);
+        }
+        if (ec && ec != boost::asio::error::would_block) {
+          close_tunnel();
+          return;
+        }
+        do_control_read();
+      }));
+  }
+
+  void do_udp_read()
+  {
+    relay_ref self(*this);
+
+    if (udp_->pause.paused) {
+      return;
+    }
+
+    udp_->socket.async_wait(udp::socket::wait_read, recycle(
+      [this, self](boost::system::error_code ec)
+      {
+        if (!ec) {
+          on_udp_readable();
+        }
+      }));
+  }
+
+  void on_udp_readable()
+  {
+    udp_batch& batch = udp_->batch;
+    int fd = udp_->socket.native_handle();
+
+    for (int round = 0; round < udp_rounds && !udp_->pause.paused; ++round) {
+      int n = batch.receive(fd);
+      size_t length = 0;
+
+      if (n <= 0) {
+        break;
+      }
+
+      for (int i = 0; i < n; ++i) {
+        length += relay_datagram(batch[i]);
+      }
+
+      metrics_add(stats_.c.datagrams_dropped, batch.flush(fd));
+      last_active_ = wheel_.now();
+      throttle(udp_->pause, length, [this]() { do_udp_read(); });
+    }
+
+    // An idle association holds no buffer
+    batch.release();
+    do_udp_read();
+  }
+
+  // Queues one datagram for the other side, returns the payload length
+  size_t relay_datagram(udp_batch::datagram& d)
+  {
+    udp::endpoint from;
+
+    memcpy(from.data(), &d.peer, std::min<size_t>(d.peer_length, sizeof(d.peer)));
+    from.resize(d.peer_length);
+
+    bool from_client = from.address() == udp_->client.address() &&
+                       (udp_->client.port() == 0 || from.port() == udp_->client.port());
+
+    if (d.truncated) {
+      metrics_add(stats_.c.datagrams_dropped, 1);
+      return 0;
+    }
+
+    if (from_client) {
+      socks5_udp_header header;
+      size_t offset = header.parse(d.data, d.length);
+
+      udp_->client.port(from.port());
+
+      // Reassembly is optional, fragments are dropped
+      if (offset == 0 || header.frag != 0) {
+        metrics_add(stats_.c.datagrams_dropped, 1);
+        return 0;
+      }
+
+      const char *payload = d.data + offset;
+      size_t length = d.length - offset;
+
+      if (header.atyp == socks5_udp_header::atyp_domain) {
+        do_udp_resolve(header.domain, header.port, payload, length);
+        return length;
+      }
+
+      udp::endpoint to;
+      if (header.atyp == socks5_udp_header::atyp_ipv6) {
+        boost::asio::ip::address_v6::bytes_type bytes;
+        memcpy(bytes.data(), header.addr, bytes.size());
+        to = udp::endpoint(boost::asio::ip::address_v6(bytes), header.port);
+      } else {
+        boost::asio::ip::address_v4::bytes_type bytes;
+        memcpy(bytes.data(), header.addr, bytes.size());
+        to = udp::endpoint(boost::asio::ip::address_v4(bytes), header.port);
+      }
+
+      if (!udp_permit(to) || !udp_->batch.send(payload, length, to.data(), to.size())) {
+        metrics_add(stats_.c.datagrams_dropped, 1);
+        return 0;
+      }
+      metrics_add(stats_.c.datagrams_upstream, 1);
+      metrics_add(stats_.c.bytes_upstream, length);
+      return length;
+    }
+
+    // Nowhere to send it before the client's port is known, and only
+    // peers the firewall permits get to answer
+    if (udp_->client.port() == 0 || !udp_permit(from)) {
+      metrics_add(stats_.c.datagrams_dropped, 1);
+      return 0;
+    }
+
+    size_t header_length = socks5_udp_header::prepend(d.peer, d.data);
+
+    udp_->batch.send(d.data - header_length, d.length + header_length,
+                     udp_->client.data(), udp_->client.size());
+    metrics_add(stats_.c.datagrams_downstream, 1);
+    metrics_add(stats_.c.bytes_downstream, d.length);
+    return d.length;
+  }
+
+  bool udp_permit(const udp::endpoint& endpoint) const
+  {
+    return endpoint.address().is_v4() &&
+           permit(socks5_request_parser::udp_associate, endpoint.address().to_v4().to_uint(), endpoint.port());
+  }
+
+  // A datagram to a name waits for the resolver, so it's copied and sent
+  // on its own
+  void do_udp_resolve(const char *host, WORD port, const char *data, size_t length)
+  {
+    auto self(shared_from_this());
+    std::shared_ptr<std::string> payload = std::make_shared<std::string>(data, length);
+
+    dns_cache::instance().resolve(
+      host,
+      io_context_,
+      [this, self, port, payload](const boost::system::error_code& ec, const dns_cache::addresses& addresses)
+      {
+        if (!ec && udp_->socket.is_open()) {
+          for (const boost::asio::ip::address& address : addresses) {
+            boost::system::error_code send_ec;
+            udp::endpoint to(address, port);
+
+            if (!udp_permit(to)) {
+              continue;
+            }
+            udp_->socket.send_to(boost::asio::buffer(*payload), to, 0, send_ec);
+            if (!send_ec) {
+              metrics_add(stats_.c.datagrams_upstream, 1);
+              metrics_add(stats_.c.bytes_upstream, payload->size());
+              return;
+            }
+            break;
+          }
+        }
+        metrics_add(stats_.c.datagrams_dropped, 1);
+      });
+  }
+
+#ifdef __linux__
+  // Relay without copying through user space:
+  // socket -> pipe -> socket, driven by readiness waits on the reactor
+  struct splice_channel {
+    int pipe_fd[2] = { -1, -1 };
+    size_t pending = 0;  // Bytes sitting in the pipe
+    bool writing = false; // Waiting for dst, that wait resumes the loop
+    relay_pause pause;
+  };
+
+  enum { splice_chunk = 0x10000, splice_rounds = 16 };
+
+  bool start_splice_relay()
+  {
+    for (splice_channel *ch : { &upstream_, &downstream_ }) {
+      if (pipe2(ch->pipe_fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        debug_log(cout << "[!] pipe2 failed, using buffered relay" << endl;);
+        close_splice_pipes();
+        return false;
+      }
+      fcntl(ch->pipe_fd[0], F_SETPIPE_SZ, splice_chunk);
+    }
+
+    client_socket_.native_non_blocking(true);
+    server_socket_.native_non_blocking(true);
+
+    do_splice(client_socket_, server_socket_, upstream_);
+    do_splice(server_socket_, client_socket_, downstream_);
+    return true;
+  }
+
+  void do_splice(tcp::socket& src, tcp::socket& dst, splice_channel& ch)
+  {
+    relay_ref self(*this);
+
+    for (int round = 0; round < splice_rounds; ++round) {
+      ssize_t n;
+
+      if (ch.pending) {
+        // Flush what's already in the pipe first
+        n = splice(ch.pipe_fd[0], NULL, dst.native_handle(), NULL, ch.pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+          ch.pending -= n;
+          metrics_add(&ch == &upstream_ ? stats_.c.bytes_upstream : stats_.c.bytes_downstream, n);
+          continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+          ch.writing = true;
+          dst.async_wait(tcp::socket::wait_write, recycle(
+            [this, self, &src, &dst, &ch](boost::system::error_code ec)
+            {
+              ch.writing = false;
+              if (!ec) {
+                do_splice(src, dst, ch);
+              } else {
+                close_tunnel();
+              }
+            }));
+          return;
+        }
+        debug_log(cout << "[!] Splice write failed (" << server_endpoint_ << ")" << endl;);
+        close_tunnel();
+        return;
+      }
+
+      // Over the limit, the pause timer picks up from here
+      if (ch.pause.paused) {
+        return;
+      }
+
+      n = splice(src.native_handle(), NULL, ch.pipe_fd[1], NULL, splice_chunk,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        ch.pending = n;
+        last_active_ = wheel_.now();
+        throttle(ch.pause, n, [this, &src, &dst, &ch]()
+          {
+            if (!ch.writing) {
+              do_splice(src, dst, ch);
+            }
+          });
+        continue;
+      }
+      if (n == -1 && errno == EAGAIN) {
+        break;
+      }
+      // EOF or error, same as a failed read in the buffered relay
+      debug_log(cout << "[!] Splice read finished (" << server_endpoint_ << ")" << endl;);
+      close_tunnel();
+      return;
+    }
+
+    // Nothing left to read, or yield to other sessions after a busy run
+    src.async_wait(tcp::socket::wait_read, recycle(
+      [this, self, &src, &dst, &ch](boost::system::error_code ec)
+      {
+        if (!ec) {
+          do_splice(src, dst, ch);
+        } else {
+          close_tunnel();
+        }
+      }));
+  }
+
+  void close_splice_pipes()
+  {
+    for (splice_channel *ch : { &upstream_, &downstream_ }) {
+      for (int& fd : ch->pipe_fd) {
+        if (fd != -1) {
+          ::close(fd);
+          fd = -1;
+        }
+      }
+    }
+  }
+
+  splice_channel upstream_;
+  splice_channel downstream_;
+#endif
+
+#ifdef SOCKS_IO_URING
+  // Relay on the thread's io_uring: each direction keeps one receive in
+  // flight and holds at most two received buffers, like the buffered relay.
+  // A buffer goes back to the ring once its bytes are written.
+  struct uring_channel;
+
+  struct uring_op
+    : uring::operation
+  {
+    uring_op(session& s, uring_channel& ch, bool send)
+      : owner(s),
+        ch(ch),
+        send(send)
+    {
+    }
+
+    void complete(int res, unsigned flags) override
+    {
+      // The request held the session, keep it for this handler only
+      relay_ref keep;
+      keep = std::move(self);
+
+      if (send) {
+        owner.on_uring_send(ch, res);
+      } else {
+        owner.on_uring_recv(ch, res, flags);
+      }
+      owner.shutdown_uring();
+    }
+
+    session& owner;
+    uring_channel& ch;
+    bool send;
+    relay_ref self;
+  };
+
+  struct uring_channel {
+    explicit uring_channel(session& s)
+      : recv_op(s, *this, false),
+        send_op(s, *this, true)
+    {
+    }
+
+    struct chunk {
+      unsigned bid;
+      size_t offset;
+      size_t length;
+    };
+
+    tcp::socket *src = NULL;
+    tcp::socket *dst = NULL;
+    std::atomic<uint64_t> *bytes = NULL;
+    uring_op recv_op;
+    uring_op send_op;
+    chunk chunks[2];
+    int head = 0;
+    int held = 0;
+    bool receiving = false;
+    bool sending = false;
+    bool eof = false;
+    relay_pause pause;
+  };
+
+  bool start_uring_relay()
+  {
+    uring& ring = uring::local(io_context_);
+
+    if (!ring.ok()) {
+      return false;
+    }
+
+    uring_ = &ring;
+    uring_up_.src = &client_socket_;
+    uring_up_.dst = &server_socket_;
+    uring_up_.bytes = &stats_.c.bytes_upstream;
+    uring_down_.src = &server_socket_;
+    uring_down_.dst = &client_socket_;
+    uring_down_.bytes = &stats_.c.bytes_downstream;
+
+    do_uring_recv(uring_up_);
+    do_uring_recv(uring_down_);
+    return true;
+  }
+
+  void do_uring_recv(uring_channel& ch)
+  {
+    if (uring_closed_ || ch.eof || ch.receiving || ch.held == 2 || ch.pause.paused) {
+      return;
+    }
+
+    ch.receiving = true;
+    ch.recv_op.self = relay_ref(*this);
+    uring_->recv(ch.src->native_handle(), &ch.recv_op);
+  }
+
+  void do_uring_send(uring_channel& ch)
+  {
+    if (uring_closed_ || ch.sending || ch.held == 0) {
+      return;
+    }
+
+    uring_channel::chunk& c = ch.chunks[ch.head];
+
+    ch.sending = true;
+    ch.send_op.self = relay_ref(*this);
+    uring_->send(ch.dst->native_handle(), uring_->buffer(c.bid) + c.offset,
+                 c.length - c.offset, &ch.send_op);
+  }
+
+  void on_uring_recv(uring_channel& ch, int res, unsigned flags)
+  {
+    ch.receiving = false;
+
+    // Every buffer is in use, wait for one to come back
+    if (res == -ENOBUFS && !uring_closed_) {
+      ch.receiving = true;
+      ch.recv_op.self = relay_ref(*this);
+      uring_->recv_when_buffered(ch.src->native_handle(), &ch.recv_op);
+      return;
+    }
+
+    if (res > 0 && uring::has_buffer(flags)) {
+      unsigned bid = uring::buffer_id(flags);
+
+      if (uring_closed_) {
+        uring_->recycle(bid);
+        return;
+      }
+
+      uring_channel::chunk& c = ch.chunks[(ch.head + ch.held) % 2];
+      c.bid = bid;
+      c.offset = 0;
+      c.length = res;
+      ++ch.held;
+
+      last_active_ = wheel_.now();
+      throttle(ch.pause, res, [this, &ch]() { do_uring_recv(ch); });
+      do_uring_send(ch);
+      do_uring_recv(ch);
+      return;
+    }
+
+    // EOF or error, whatever is still held is written first
+    debug_log(cout << "[!] Read finished (" << server_endpoint_ << ")" << endl;);
+    ch.eof = true;
+    if (ch.held == 0) {
+      close_uring();
+    }
+  }
+
+  void on_uring_send(uring_channel& ch, int res)
+  {
+    ch.sending = false;
+
+    if (uring_closed_ || res <= 0) {
+      debug_log(cout << "[!] Write failed (" << server_endpoint_ << ")" << endl;);
+      release_uring_buffers(ch);
+      close_uring();
+      return;
+    }
+
+    metrics_add(*ch.bytes, res);
+
+    uring_channel::chunk& c = ch.chunks[ch.head];
+    c.offset += res;
+    if (c.offset == c.length) {
+      uring_->recycle(c.bid);
+      ch.head = 1 - ch.head;
+      --ch.held;
+    }
+
+    if (ch.eof && ch.held == 0) {
+      close_uring();
+      return;
+    }
+
+    do_uring_send(ch);
+    do_uring_recv(ch);
+  }
+
+  // The buffer of a write still in flight comes back when it completes
+  void release_uring_buffers(uring_channel& ch)
+  {
+    while (ch.held > (ch.sending ? 1 : 0)) {
+      uring_->recycle(ch.chunks[(ch.head + ch.held - 1) % 2].bid);
+      --ch.held;
+    }
+  }
+
+  // Pending requests are cancelled first and the sockets are only shut
+  // down once the ring gave all of them back, see shutdown_uring()
+  void close_uring()
+  {
+    if (uring_closed_) {
+      return;
+    }
+    uring_closed_ = true;
+
+    for (tcp::socket *socket : { &client_socket_, &server_socket_ }) {
+      if (socket->is_open()) {
+        uring_->cancel_fd(socket->native_handle());
+      }
+    }
+    release_uring_buffers(uring_up_);
+    release_uring_buffers(uring_down_);
+  }
+
+  // Tells both peers right away, the sockets themselves close with the
+  // session
+  void shutdown_uring()
+  {
+    if (!uring_closed_ || uring_up_.receiving || uring_up_.sending ||
+        uring_down_.receiving || uring_down_.sending) {
+      return;
+    }
+    for (tcp::socket *socket : { &client_socket_, &server_socket_ }) {
+      if (socket->is_open()) {
+        ::shutdown(socket->native_handle(), SHUT_RDWR);
+      }
+    }
+  }
+#endif
+
+  boost::asio::io_context& io_context_;
+  tcp::socket client_socket_;
+  tcp::socket server_socket_;
+  std::unique_ptr<handshake> handshake_;  // Gone once the tunnel relays
+  BYTE version_;          // 4 or 5, from the first byte
+  BYTE cd_;
+  int relay_wait_;
+  int relay_refs_;        // Live relay_refs, see relay_ref
+  std::shared_ptr<session> relay_self_;
+  relay_channel client_relay_;
+  relay_channel server_relay_;
+  tcp::endpoint server_endpoint_;
+  WORD bind_port_;
+  std::shared_ptr<const firewall_rules> rules_;
+  mutable uint32_t client_ip_;  // 0 until client_ip() looked it up
+  metrics::block& stats_;
+  std::chrono::steady_clock::time_point phase_start_;
+  rate_limits::buckets buckets_;
+  timer_wheel& wheel_;
+  session_timeout timeout_;
+  uint64_t last_active_;  // Wheel tick of the last relayed read
+  std::unique_ptr<udp_association> udp_;
+#ifdef SOCKS_IO_URING
+  uring *uring_;          // Set once the relay runs on io_uring
+  bool uring_closed_;
+  uring_channel uring_up_;
+  uring_channel uring_down_;
+#endif
+};
+
+// Buckets live in the process that relays, with a child per connection
+// every tunnel has buckets of its own
+static void warn_fork_limits()
+{
+  if (!g_config.threads && !firewall::current()->limits().empty()) {
+    cerr << "[!] Fork mode: limit rules cap each connection, use -t to share them" << endl;
+  }
+}
+
+static void dump_stats(ostream& os)
+{
+  os << "relay_memory bytes=" << relay_channel::memory() << "\n";
+  os << "udp_gso " << (udp_batch::gso_enabled() ? "on" : "off") << "\n";
+  buffer_pool::dump_stats(os);
+  dns_cache::instance().dump_stats(os);
+  dns_client::dump_stats(os);
+  port_allocator::instance().dump_stats(os);
+  access_log::instance().dump_stats(os);
+  admission::instance().dump_stats(os);
+  alloc_stats::dump_stats(os);
+#ifdef SOCKS_IO_URING
+  uring::dump_stats(os);
+#endif
+  os << flush;
+}
+
+// Prometheus text for /metrics
+static void write_metrics(ostream& os)
+{
+  metrics::write_prometheus(os);
+
+  os << "# HELP socks_relay_memory_bytes Relay buffer memory held by sessions\n"
+     << "# TYPE socks_relay_memory_bytes gauge\n"
+     << "socks_relay_memory_bytes " << relay_channel::memory() << "\n";
+
+  buffer_pool::totals pool = buffer_pool::total();
+  metrics::counter(os, "socks_buffer_pool_hits_total", "Relay buffers served from a pool", pool.hits);
+  metrics::counter(os, "socks_buffer_pool_misses_total", "Relay buffers allocated", pool.misses);
+  metrics::counter(os, "socks_buffer_pool_frees_total", "Relay buffers given back to the allocator", pool.frees);
+
+  dns_cache::totals dns = dns_cache::instance().total();
+  metrics::counter(os, "socks_dns_cache_hits_total", "Lookups answered from the cache", dns.hits);
+  metrics::counter(os, "socks_dns_cache_negative_hits_total", "Failed lookups answered from the cache", dns.negative_hits);
+  metrics::counter(os, "socks_dns_cache_misses_total", "Lookups sent to the resolver", dns.misses);
+  metrics::counter(os, "socks_dns_cache_coalesced_total", "Lookups that joined one in flight", dns.coalesced);
+  metrics::counter(os, "socks_dns_queries_total", "Queries sent to DNS servers, retries included", dns_client::query_count());
+  metrics::counter(os, "socks_dns_retries_total", "Queries sent again after a timeout or server failure", dns_client::retry_count());
+  metrics::counter(os, "socks_dns_timeouts_total", "Lookups that ran out of attempts without an answer", dns_client::timeout_count());
+
+  port_allocator::totals ports = port_allocator::instance().total();
+  metrics::counter(os, "socks_bind_port_allocations_total", "BIND ports handed out", ports.allocations);
+  metrics::counter(os, "socks_bind_port_exhausted_total", "BIND requests with no port left", ports.exhausted);
+  metrics::counter(os, "socks_bind_port_busy_total", "BIND ports found in use by others", ports.busy);
+
+  metrics::counter(os, "socks_access_log_written_total", "Access log records written", access_log::instance().written());
+  metrics::counter(os, "socks_access_log_dropped_total", "Access log records dropped", access_log::instance().dropped());
+
+  admission& control = admission::instance();
+  os << "# HELP socks_sessions_max Session limit, 0 when unlimited\n"
+     << "# TYPE socks_sessions_max gauge\n"
+     << "socks_sessions_max " << control.max_sessions() << "\n";
+  metrics::counter(os, "socks_accept_wakeups_total", "Times an accept loop found connections queued", control.wakeup_count());
+  metrics::counter(os, "socks_accept_paused_total", "Times accepting paused at the session limit", control.paused_count());
+  metrics::counter(os, "socks_accept_errors_total", "Failed accepts", control.error_count());
+  metrics::counter(os, "socks_accept_shed_total", "Connections closed unserved for lack of descriptors", control.shed_count());
+
+  metrics::counter(os, "socks_heap_allocations_total", "Calls to operator new", alloc_stats::allocation_count());
+  metrics::counter(os, "socks_heap_allocated_bytes_total", "Bytes requested from operator new", alloc_stats::allocated_bytes());
+
+#ifdef SOCKS_IO_URING
+  metrics::counter(os, "socks_uring_submits_total", "io_uring_enter calls submitting requests", uring::submits());
+  metrics::counter(os, "socks_uring_completions_total", "io_uring completions handled", uring::completions());
+#endif
+}
+
+// Plain HTTP, every request gets the metrics and the connection is closed
+class metrics_server
+{
+public:
+  metrics_server(boost::asio::io_context& io_context, const tcp::endpoint& endpoint)
+    : acceptor_(io_context, endpoint),
+      timer_(io_context)
+  {
+    do_accept();
+  }
+
+  // Serves on a listener handed over by the previous process
+  metrics_server(boost::asio::io_context& io_context, int fd)
+    : acceptor_(io_context, tcp::v4(), fd),
+      timer_(io_context)
+  {
+    do_accept();
+  }
+
+  int native_handle()
+  {
+    return acceptor_.native_handle();
+  }
+
+  void close()
+  {
+    boost::system::error_code ec;
+    timer_.cancel();
+    acceptor_.close(ec);
+  }
+
+private:
+  class connection
+    : public std::enable_shared_from_this<connection>
+  {
+  public:
+    explicit connection(tcp::socket socket)
+      : socket_(std::move(socket))
+    {
+    }
+
+    void start()
+    {
+      auto self(shared_from_this());
+      boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+        {
+          if (ec) {
+            return;
+          }
+
+          std::ostringstream body;
+          write_metrics(body);
+
+          std::ostringstream response;
+          response << "HTTP/1.0 200 OK\r\n"
+                   << "Content-Type: text/plain; version=0.0.4\r\n"
+                   << "Content-Length: " << body.str().size() << "\r\n"
+                   << "Connection: close\r\n\r\n"
+                   << body.str();
+          response_ = response.str();
+
+          boost::asio::async_write(socket_, boost::asio::buffer(response_),
+            [this, self](boost::system::error_code /*ec*/, std::size_t /*length*/)
+            {
+              boost::system::error_code ignored;
+              socket_.shutdown(tcp::socket::shutdown_both, ignored);
+            });
+        });
+    }
+
+  private:
+    tcp::socket socket_;
+    boost::asio::streambuf request_;
+    string response_;
+  };
+
+  void do_accept()
+  {
+    acceptor_.async_accept(
+      [this](boost::system::error_code ec, tcp::socket socket)
+      {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+        if (!ec) {
+          std::make_shared<connection>(std::move(socket))->start();
+        } else if (admission::out_of_resources(ec.value())) {
+          // Scrapes wait in the backlog until descriptors are free again
+          timer_.expires_after(std::chrono::milliseconds(admission::backoff_ms));
+          timer_.async_wait(
+            [this](boost::system::error_code ec)
+            {
+              if (!ec) {
+                do_accept();
+              }
+            });
+          return;
+        }
+        do_accept();
+      });
+  }
+
+  tcp::acceptor acceptor_;
+  boost::asio::steady_timer timer_;
+};
+
+class io_context_pool
+{
+public:
+  explicit io_context_pool(size_t size)
+    : next_(0)
+  {
+    for (size_t i = 0; i < size; ++i) {
+      io_contexts_.push_back(std::make_shared<boost::asio::io_context>(1));
+      work_.push_back(boost::asio::make_work_guard(*io_contexts_.back()));
+    }
+  }
+
+  // One thread per io_context, a session stays on the thread it was given
+  void start()
+  {
+    for (size_t i = 0; i < io_contexts_.size(); ++i) {
+      boost::asio::io_context& io_context = *io_contexts_[i];
+      threads_.emplace_back([&io_context]()
+        {
+          run(io_context);
+        });
+
+      if (g_config.pin_cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu(i), &set);
+        if (pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set), &set) != 0) {
+          cerr << "[!] Can't pin worker " << i << " to CPU " << cpu(i) << endl;
+        }
+      }
+    }
+  }
+
+  // Worker i runs on the i-th CPU the process may use, wrapping around
+  int cpu(size_t i) const
+  {
+    cpu_set_t set;
+    vector<int> cpus;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &set)) {
+          cpus.push_back(c);
+        }
+      }
+    }
+    return cpus.empty() ? (int)i : cpus[i % cpus.size()];
+  }
+
+  size_t size() const
+  {
+    return io_contexts_.size();
+  }
+
+  boost::asio::io_context& get_io_context(size_t i)
+  {
+    return *io_contexts_[i];
+  }
+
+  void stop()
+  {
+    for (auto& work : work_) {
+      work.reset();
+    }
+    for (auto& io_context : io_contexts_) {
+      io_context->stop();
+    }
+  }
+
+  void join()
+  {
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  boost::asio::io_context& get_io_context()
+  {
+    boost::asio::io_context& io_context = *io_contexts_[next_];
+    next_ = (next_ + 1) % io_contexts_.size();
+    return io_context;
+  }
+
+  static void run(boost::asio::io_context& io_context)
+  {
+    // A socket error thrown out of a handler only kills the session that
+    // threw it, not the worker. Anything else is a bug and ends the process.
+    while (true) {
+      try
+      {
+        io_context.run();
+        break;
+      }
+      catch (boost::system::system_error& e)
+      {
+        cerr << "[!] Worker exception, resuming: " << e.what() << endl;
+      }
+    }
+  }
+
+private:
+  typedef boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
+
+  vector<std::shared_ptr<boost::asio::io_context>> io_contexts_;
+  vector<work_guard> work_;
+  vector<std::thread> threads_;
+  size_t next_;
+};
+
+// Takes what is queued on a non-blocking acceptor in one go, up to a batch
+// and as far as the session limit allows. start gets each descriptor.
+// Returns the delay before accepting again, 0 to wait for more connections.
+template <typename Start>
+static int accept_batch(tcp::acceptor& acceptor, bool& paused, Start start)
+{
+  admission& control = admission::instance();
+
+  control.woke();
+  for (int i = 0; i < admission::batch; ++i) {
+    if (!control.admit(session::open_count().load(std::memory_order_relaxed), paused)) {
+      return admission::recheck_ms;
+    }
+
+    int fd = ::accept4(acceptor.native_handle(), NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1) {
+      int err = errno;
+
+      if (err == EAGAIN || err == EWOULDBLOCK) {
+        return 0;
+      }
+      debug_log(cout << "[x] Accept error: " << strerror(err) << endl;);
+      if (int delay = control.failed(err, acceptor.native_handle())) {
+        return delay;
+      }
+      continue;
+    }
+
+    start(fd);
+  }
+  return 0;
+}
+
+// With --reuseport every worker listens on the port itself. The kernel
+// spreads connections over the listeners, and a connection is accepted,
+// parsed and relayed on one thread without a hand-off.
+class listener
+{
+public:
+  typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+  typedef boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU> incoming_cpu;
+
+  // cpu < 0 leaves connection steering to the kernel's hash, fd is a
+  // listener handed over by the previous process or -1
+  listener(boost::asio::io_context& io_context, short port, int cpu, int fd)
+    : io_context_(io_context),
+      acceptor_(io_context),
+      accept_timer_(io_context),
+      accept_paused_(false)
+#ifdef SOCKS_IO_URING
+      ,
+      uring_(NULL),
+      accept_op_(*this),
+      accepting_(false),
+      stopping_(false),
+      closing_(false),
+      accept_delay_(0)
+#endif
+  {
+    tcp::endpoint endpoint(tcp::v4(), port);
+
+    if (fd != -1) {
+      acceptor_.assign(tcp::v4(), fd);
+    } else {
+      acceptor_.open(endpoint.protocol());
+      acceptor_.set_option(tcp::acceptor::reuse_address(true));
+      acceptor_.set_option(reuse_port(true));
+    }
+    if (cpu >= 0) {
+      acceptor_.set_option(incoming_cpu(cpu));
+    }
+    if (fd == -1) {
+      acceptor_.bind(endpoint);
+      acceptor_.listen();
+    }
+
+    // Per-thread state has to be picked up on the worker
+    boost::asio::post(io_context_, [this]()
+      {
+#ifdef SOCKS_IO_URING
+        uring& ring = uring::local(io_context_);
+        if (ring.ok()) {
+          uring_ = &ring;
+        } else
+#endif
+        {
+          acceptor_.non_blocking(true);
+        }
+        do_accept();
+      });
+  }
+
+  int native_handle()
+  {
+    return acceptor_.native_handle();
+  }
+
+  // Stops accepting on the worker's thread, the socket itself lives on in
+  // the process it was handed to. The ring cancels by descriptor, so with
+  // io_uring the acceptor is closed once the accept request has ended.
+  void close()
+  {
+    boost::asio::post(io_context_, [this]()
+      {
+        boost::system::error_code ec;
+#ifdef SOCKS_IO_URING
+        if (accepting_) {
+          closing_ = true;
+          uring_->cancel_fd(acceptor_.native_handle());
+          return;
+        }
+#endif
+        accept_timer_.cancel();
+        acceptor_.close(ec);
+      });
+  }
+
+private:
+  void do_accept()
+  {
+    if (!acceptor_.is_open()) {
+      return;
+    }
+    if (!admission::instance().admit(session::open_count().load(std::memory_order_relaxed), accept_paused_)) {
+      retry_accept(admission::recheck_ms);
+      return;
+    }
+#ifdef SOCKS_IO_URING
+    if (uring_) {
+      do_accept_uring();
+      return;
+    }
+#endif
+    acceptor_.async_wait(tcp::acceptor::wait_read,
+      [this](boost::system::error_code ec)
+      {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+
+        int delay = ec ? (int)admission::backoff_ms :
+          accept_batch(acceptor_, accept_paused_, [this](int fd) { start_session(fd); });
+
+        if (delay) {
+          retry_accept(delay);
+        } else {
+          do_accept();
+        }
+      });
+  }
+
+  void retry_accept(int ms)
+  {
+    accept_timer_.expires_after(std::chrono::milliseconds(ms));
+    accept_timer_.async_wait(
+      [this](boost::system::error_code ec)
+      {
+        if (!ec) {
+          do_accept();
+        }
+      });
+  }
+
+#ifdef SOCKS_IO_URING
+  // A multishot request takes everything queued before its completions are
+  // seen, under a session limit connections are taken one at a time
+  void do_accept_uring()
+  {
+    accepting_ = true;
+    if (admission::instance().max_sessions()) {
+      uring_->accept(acceptor_.native_handle(), &accept_op_);
+    } else {
+      uring_->accept_multishot(acceptor_.native_handle(), &accept_op_);
+    }
+  }
+#endif
+
+  void start_session(int fd)
+  {
+    tcp::socket socket(io_context_);
+    boost::system::error_code ec;
+
+    socket.assign(tcp::v4(), fd, ec);
+    if (ec) {
+      ::close(fd);
+    } else {
+      session::open_count().fetch_add(1, std::memory_order_relaxed);
+      std::make_shared<session>(std::move(socket), io_context_)->start();
+    }
+  }
+
+#ifdef SOCKS_IO_URING
+  struct accept_op
+    : uring::operation
+  {
+    explicit accept_op(listener& l)
+      : owner(l)
+    {
+    }
+
+    void complete(int res, unsigned flags) override
+    {
+      owner.on_uring_accept(res, flags);
+    }
+
+    listener& owner;
+  };
+
+  // Over the limit or out of resources the request is cancelled, the timer
+  // or the next check arms a new one
+  void on_uring_accept(int res, unsigned flags)
+  {
+    admission& control = admission::instance();
+
+    if (res >= 0) {
+      start_session(res);
+    } else if (res != -ECANCELED) {
+      debug_log(cout << "[x] Accept error: " << strerror(-res) << endl;);
+      accept_delay_ = std::max(accept_delay_, control.failed(-res, acceptor_.native_handle()));
+    }
+
+    if (flags & IORING_CQE_F_MORE) {
+      if (!closing_ && !stopping_ && (accept_delay_ ||
+          !control.admit(session::open_count().load(std::memory_order_relaxed), accept_paused_))) {
+        stopping_ = true;
+        uring_->cancel_fd(acceptor_.native_handle());
+      }
+      return;
+    }
+
+    accepting_ = false;
+    stopping_ = false;
+    if (closing_) {
+      boost::system::error_code ec;
+      acceptor_.close(ec);
+    } else if (accept_delay_) {
+      retry_accept(accept_delay_);
+      accept_delay_ = 0;
+    } else {
+      do_accept();
+    }
+  }
+#endif
+
+  boost::asio::io_context& io_context_;
+  tcp::acceptor acceptor_;
+  boost::asio::steady_timer accept_timer_;
+  bool accept_paused_;
+#ifdef SOCKS_IO_URING
+  uring *uring_;
+  accept_op accept_op_;
+  bool accepting_;  // A multishot request is armed
+  bool stopping_;   // and cancelled for admission
+  bool closing_;
+  int accept_delay_;
+#endif
+};
+
+class server
+{
+public:
+  // Without a pool every connection is handled by a forked child. Listeners
+  // in inherited were handed over by the previous process.
+  server(boost::asio::io_context& io_context, short port, io_context_pool *pool,
+         const handoff::sockets& inherited)
+    : io_context_(io_context),
+      acceptor_(io_context),
+      signal_(io_context),
+      pool_(pool),
+      accept_timer_(io_context),
+      accept_paused_(false),
+      draining_(false),
+      drain_timer_(io_context)
+#ifdef SOCKS_IO_URING
+      ,
+      uring_(NULL),
+      accept_op_(*this),
+      accepting_(false),
+      stopping_(false),
+      accept_delay_(0)
+#endif
+  {
+    const vector<int>& fds = inherited.listeners;
+
+    if (pool_ && g_config.reuseport) {
+      // Every inherited listener keeps being served, queued connections
+      // included, workers without one open their own
+      for (size_t i = 0; i < std::max(pool_->size(), fds.size()); ++i) {
+        int cpu = g_config.incoming_cpu ? pool_->cpu(i) : -1;
+        listeners_.emplace_back(new listener(pool_->get_io_context(i % pool_->size()), port, cpu,
+                                             i < fds.size() ? fds[i] : -1));
+      }
+    } else if (!fds.empty()) {
+      acceptor_.assign(tcp::v4(), fds[0]);
+      for (size_t i = 1; i < fds.size(); ++i) {
+        ::close(fds[i]);
+      }
+    } else {
+      tcp::endpoint endpoint(tcp::v4(), port);
+      acceptor_.open(endpoint.protocol());
+      acceptor_.set_option(tcp::acceptor::reuse_address(true));
+      acceptor_.bind(endpoint);
+      acceptor_.listen();
+    }
+
+    if (inherited.metrics != -1 && g_config.metrics_port) {
+      metrics_.reset(new metrics_server(io_context, inherited.metrics));
+    } else if (g_config.metrics_port) {
+      if (inherited.metrics != -1) {
+        ::close(inherited.metrics);
+      }
+      tcp::endpoint endpoint(boost::asio::ip::make_address(g_config.metrics_address), g_config.metrics_port);
+      metrics_.reset(new metrics_server(io_context, endpoint));
+    } else if (inherited.metrics != -1) {
+      ::close(inherited.metrics);
+    }
+    if (!pool_) {
+      signal_.add(SIGCHLD);
+    }
+    signal_.add(SIGHUP);
+    signal_.add(SIGUSR1);
+    signal_.add(SIGINT);
+    signal_.add(SIGTERM);
+    wait_for_signal();
+#ifdef SOCKS_IO_URING
+    // io_uring serves thread mode, forked children stay on epoll
+    if (pool_ && listeners_.empty()) {
+      uring& ring = uring::local(io_context_);
+      if (ring.ok()) {
+        uring_ = &ring;
+        // A multishot accept fills the descriptor table before any of its
+        // completions are seen, workers set up their rings ahead of that
+        for (size_t i = 0; i < pool_->size(); ++i) {
+          boost::asio::io_context& worker = pool_->get_io_context(i);
+          boost::asio::post(worker, [&worker]() { uring::local(worker); });
+        }
+      } else {
+        cerr << "[!] io_uring unavailable, using epoll" << endl;
+      }
+    }
+    if (pool_ && listeners_.empty() && !uring_)
+#else
+    if (pool_ && listeners_.empty())
+#endif
+    {
+      // Accepted in batches until the queue is empty
+      acceptor_.non_blocking(true);
+    }
+    admission::instance().reserve();
+    do_accept();
   }
 
-  void do_client_read() {
-    auto self(shared_from_this());
-    client_socket_.async_read_some(boost::asio::buffer(data_, max_length),
-      [this, self](boost::system::error_code ec, std::size_t length)
-      {
-        if (!ec) {
-          debug_log(debug_dump(data_, length););
-          do_server_write(length);
-        } else {
-          debug_log(cout << "[!] (Client) Read failed" << endl;);
-          server_socket_.close();
-        }
-      });
+  // Waits for the next binary on g_config.upgrade_socket
+  void listen_for_upgrade()
+  {
+    if (g_config.upgrade_socket.empty()) {
+      return;
+    }
+
+    // Whoever can connect can take the listeners, the socket is created
+    // 0600. No worker runs yet, so the process umask can be borrowed.
+    ::unlink(g_config.upgrade_socket.c_str());
+    mode_t mask = ::umask(0177);
+    try {
+      upgrade_acceptor_.reset(new boost::asio::local::stream_protocol::acceptor(io_context_,
+        boost::asio::local::stream_protocol::endpoint(g_config.upgrade_socket)));
+    } catch (...) {
+      ::umask(mask);
+      throw;
+    }
+    ::umask(mask);
+    do_accept_upgrade();
   }
 
-  void do_client_write(int length) {
-    auto self(shared_from_this());
+private:
+  typedef boost::asio::local::stream_protocol::socket upgrade_socket;
 
-    boost::asio::async_write(client_socket_, boost::asio::buffer(data2_, length),
-      [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-        if (!ec) {
-          debug_log(cout << "[O] (Client) Write OK (" << server_endpoint_ << ")" << endl;);
-        } else {
-          debug_log(cout << "[!] (Client) Write failed (" << server_endpoint_ << ")" << endl;);
+  void do_accept_upgrade()
+  {
+    upgrade_acceptor_->async_accept(
+      [this](boost::system::error_code ec, upgrade_socket socket)
+      {
+        if (ec) {
+          return;
+        }
+        if (!handoff::trusted_peer(socket.native_handle())) {
+          cerr << "[!] Upgrade refused, peer runs as another user" << endl;
+          do_accept_upgrade();
+          return;
         }
-        do_server_read();
+        upgrade_peer_ = std::make_shared<upgrade_socket>(std::move(socket));
+        do_hand_over(upgrade_peer_);
       });
   }
 
-  void do_server_read() {
-    auto self(shared_from_this());
-    server_socket_.async_read_some(boost::asio::buffer(data2_, max_length),
-      [this, self](boost::system::error_code ec, std::size_t length)
+  // The new process asks for the listeners and confirms once it serves
+  // them. Until then this one keeps accepting, a failed upgrade costs
+  // nothing.
+  void do_hand_over(std::shared_ptr<upgrade_socket> peer)
+  {
+    std::shared_ptr<std::array<char, 4>> buf = std::make_shared<std::array<char, 4>>();
+
+    boost::asio::async_read(*peer, boost::asio::buffer(*buf),
+      [this, peer, buf](boost::system::error_code ec, std::size_t /*length*/)
       {
-        if (!ec) {
-          debug_log(debug_dump(data2_, length););
-          do_client_write(length);
-        } else {
-          debug_log(cout << "[!] (Server) Read failed" << server_endpoint_ << endl;);
-          client_socket_.close();
+        // Closed in a forked child
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
         }
+        if (ec || memcmp(buf->data(), handoff::request(), buf->size()) != 0 ||
+            !handoff::send(peer->native_handle(), listening_sockets())) {
+          cerr << "[!] Upgrade handoff failed" << endl;
+          upgrade_peer_.reset();
+          do_accept_upgrade();
+          return;
+        }
+
+        boost::asio::async_read(*peer, boost::asio::buffer(buf->data(), 1),
+          [this, peer, buf](boost::system::error_code ec, std::size_t /*length*/)
+          {
+            if (ec == boost::asio::error::operation_aborted) {
+              return;
+            }
+            if (ec) {
+              cerr << "[!] Upgrade not confirmed, still serving" << endl;
+              upgrade_peer_.reset();
+              do_accept_upgrade();
+              return;
+            }
+
+            // Closing the connection tells the new process the path is free
+            stop_accepting();
+            peer->close(ec);
+            upgrade_peer_.reset();
+            drain();
+          });
       });
   }
 
-  void do_server_write(int length) {
-    auto self(shared_from_this());
+  handoff::sockets listening_sockets()
+  {
+    handoff::sockets s;
+
+    for (auto& l : listeners_) {
+      s.listeners.push_back(l->native_handle());
+    }
+    if (acceptor_.is_open()) {
+      s.listeners.push_back(acceptor_.native_handle());
+    }
+    if (metrics_) {
+      s.metrics = metrics_->native_handle();
+    }
+    return s;
+  }
+
+  void stop_accepting()
+  {
+    boost::system::error_code ec;
+
+    draining_ = true;
+    for (auto& l : listeners_) {
+      l->close();
+    }
+    accept_timer_.cancel();
+#ifdef SOCKS_IO_URING
+    // Closed when the accept request has ended, see on_uring_accept()
+    if (accepting_) {
+      uring_->cancel_fd(acceptor_.native_handle());
+    } else
+#endif
+    {
+      acceptor_.close(ec);
+    }
+    if (metrics_) {
+      metrics_->close();
+    }
+    upgrade_acceptor_->close(ec);
+  }
+
+  // Sessions finish on their own until the deadline, whatever is left then
+  // is cut off
+  void drain()
+  {
+    cerr << "[*] Listeners handed over, draining for up to "
+         << g_config.drain_timeout.count() << "s" << endl;
+    drain_deadline_ = std::chrono::steady_clock::now() + g_config.drain_timeout;
+    wait_drained();
+  }
 
-    boost::asio::async_write(server_socket_, boost::asio::buffer(data_, length),
-      [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+  // Checks every tick. Waiting before the first check also lets accepts
+  // that were already in flight become sessions.
+  void wait_drained()
+  {
+    drain_timer_.expires_after(std::chrono::milliseconds(100));
+    drain_timer_.async_wait(
+      [this](boost::system::error_code ec)
+      {
         if (!ec) {
-          debug_log(cout << "[O] (Server) Write OK (" << server_endpoint_ << ")" << endl;);
-        } else {
-          debug_log(cout << "[!] (Server) Write failed (" << server_endpoint_ << ")" << endl;);
+          check_drained();
         }
-        do_client_read();
       });
   }
 
-  boost::asio::io_context& io_context_;
-  tcp::socket client_socket_;
-  tcp::socket server_socket_;
-  enum { max_length = 1024 };
-  char data_[max_length];
-  char data2_[max_length];
-  BYTE cd_;
-  BYTE reply_cnt_;
-  tcp::resolver resolver_;
-  tcp::endpoint server_endpoint_;
-  tcp::acceptor *p_acceptor_;
-};
-
-class server
-{
-public:
-  server(boost::asio::io_context& io_context, short port)
-    : io_context_(io_context),
-      acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-      signal_(io_context, SIGCHLD)
+  void check_drained()
   {
-    wait_for_signal();
-    do_accept();
+    metrics::totals t = metrics::total();
+    size_t left = pool_ ? t.accepted - t.closed : children_.size();
+
+    if (left == 0 || std::chrono::steady_clock::now() >= drain_deadline_) {
+      if (left) {
+        cerr << "[!] Drain deadline, closing " << left << " sessions" << endl;
+        for (pid_t pid : children_) {
+          kill(pid, SIGKILL);
+        }
+      }
+      io_context_.stop();
+      return;
+    }
+
+    wait_drained();
   }
 
-private:
   void wait_for_signal()
   {
     signal_.async_wait(
-      [this](boost::system::error_code /*ec*/, int /*signo*/)
+      [this](boost::system::error_code ec, int signo)
       {
-        if (acceptor_.is_open()) {
-          int status = 0;
-          while (waitpid(-1, &status, WNOHANG) > 0) {}
+        if (ec) {
+          return;
+        }
+
+        // Forked children close the acceptor and ignore signals
+        if (acceptor_.is_open() || !listeners_.empty() || draining_) {
+          if (signo == SIGCHLD) {
+            int status = 0;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+              children_.erase(pid);
+            }
+          } else if (signo == SIGHUP) {
+            // Sessions already running keep the rules they started with
+            if (firewall::reload(g_config.firewall_file)) {
+              cerr << "[*] " << g_config.firewall_file << " reloaded" << endl;
+              warn_fork_limits();
+            } else {
+              cerr << "[!] " << g_config.firewall_file << " reload failed, keeping old rules" << endl;
+            }
+          } else if (signo == SIGUSR1) {
+            dump_stats(cerr);
+          } else if (signo == SIGINT || signo == SIGTERM) {
+            // Let main() shut the workers down and flush the access log
+            io_context_.stop();
+            return;
+          }
 
           wait_for_signal();
         }
       });
   }
 
+  // Sessions in worker threads, or forked children
+  size_t open_sessions() const
+  {
+    return pool_ ? session::open_count().load(std::memory_order_relaxed) : children_.size();
+  }
+
+  // At the session limit new connections stay in the listen backlog until
+  // enough sessions have finished
   void do_accept()
+  {
+    if (!listeners_.empty() || draining_ || !acceptor_.is_open()) {
+      return;
+    }
+    if (!admission::instance().admit(open_sessions(), accept_paused_)) {
+      retry_accept(admission::recheck_ms);
+      return;
+    }
+#ifdef SOCKS_IO_URING
+    if (uring_) {
+      do_accept_uring();
+      return;
+    }
+#endif
+    if (pool_) {
+      do_accept_thread();
+    } else {
+      do_accept_fork();
+    }
+  }
+
+  void retry_accept(int ms)
+  {
+    accept_timer_.expires_after(std::chrono::milliseconds(ms));
+    accept_timer_.async_wait(
+      [this](boost::system::error_code ec)
+      {
+        if (!ec) {
+          do_accept();
+        }
+      });
+  }
+
+  void do_accept_thread()
+  {
+    acceptor_.async_wait(tcp::acceptor::wait_read,
+      [this](boost::system::error_code ec)
+      {
+        if (ec == boost::asio::error::operation_aborted) {
+          return;
+        }
+
+        int delay = ec ? (int)admission::backoff_ms :
+          accept_batch(acceptor_, accept_paused_, [this](int fd) { start_session(fd); });
+
+        if (delay) {
+          retry_accept(delay);
+        } else {
+          do_accept();
+        }
+      });
+  }
+
+  // Sessions are built and started on their own thread, so the per-thread
+  // state they pick up (metrics, timer wheel, io_uring) is that thread's.
+  // Only the descriptor crosses over, the socket belongs to the worker.
+  void start_session(int fd)
+  {
+    boost::asio::io_context& io_context = pool_->get_io_context();
+
+    session::open_count().fetch_add(1, std::memory_order_relaxed);
+    boost::asio::post(io_context, [&io_context, fd]()
+      {
+        tcp::socket socket(io_context);
+        boost::system::error_code ec;
+
+        socket.assign(tcp::v4(), fd, ec);
+        if (ec) {
+          ::close(fd);
+          session::open_count().fetch_sub(1, std::memory_order_relaxed);
+          return;
+        }
+        std::make_shared<session>(std::move(socket), io_context)->start();
+      });
+  }
+
+#ifdef SOCKS_IO_URING
+  // Multishot accept: one request keeps delivering connections
+  struct accept_op
+    : uring::operation
+  {
+    explicit accept_op(server& s)
+      : owner(s)
+    {
+    }
+
+    void complete(int res, unsigned flags) override
+    {
+      owner.on_uring_accept(res, flags);
+    }
+
+    server& owner;
+  };
+
+  // Same as listener::do_accept_uring()
+  void do_accept_uring()
+  {
+    accepting_ = true;
+    if (admission::instance().max_sessions()) {
+      uring_->accept(acceptor_.native_handle(), &accept_op_);
+    } else {
+      uring_->accept_multishot(acceptor_.native_handle(), &accept_op_);
+    }
+  }
+
+  // Same as listener::on_uring_accept()
+  void on_uring_accept(int res, unsigned flags)
+  {
+    admission& control = admission::instance();
+
+    if (res >= 0) {
+      start_session(res);
+    } else if (res != -ECANCELED) {
+      debug_log(cout << "[x] Accept error: " << strerror(-res) << endl;);
+      accept_delay_ = std::max(accept_delay_, control.failed(-res, acceptor_.native_handle()));
+    }
+
+    if (flags & IORING_CQE_F_MORE) {
+      if (!draining_ && !stopping_ && (accept_delay_ || !control.admit(open_sessions(), accept_paused_))) {
+        stopping_ = true;
+        uring_->cancel_fd(acceptor_.native_handle());
+      }
+      return;
+    }
+
+    accepting_ = false;
+    stopping_ = false;
+    if (draining_) {
+      boost::system::error_code ec;
+      acceptor_.close(ec);
+    } else if (accept_delay_) {
+      retry_accept(accept_delay_);
+      accept_delay_ = 0;
+    } else {
+      do_accept();
+    }
+  }
+#endif
+
+  void do_accept_fork()
   {
     acceptor_.async_accept(
       [this](boost::system::error_code ec, tcp::socket socket)
@@ -603,6 +2990,7 @@ private:
           if ((pid = fork())) {
             // Parent
             io_context_.notify_fork(boost::asio::io_context::fork_parent);
+            children_.insert(pid);
             socket.close();
             do_accept();
           } else if (pid == 0) {
@@ -610,15 +2998,30 @@ private:
             io_context_.notify_fork(boost::asio::io_context::fork_child);
             signal_.cancel();
             acceptor_.close();
+            if (metrics_) {
+              metrics_->close();
+            }
+            // A child must not hold the handoff open either
+            if (upgrade_acceptor_) {
+              upgrade_acceptor_->close();
+            }
+            if (upgrade_peer_) {
+              upgrade_peer_->close();
+            }
+            session::open_count().fetch_add(1, std::memory_order_relaxed);
             std::make_shared<session>(std::move(socket), io_context_)->start();
           } else {
             // Error
             debug_log(cout << "[x] Fork error" << endl;);
             exit(1);
           }
-        } else {
-          debug_log(cout << "[x] Accept error" << endl;);
-          do_accept();
+        } else if (ec != boost::asio::error::operation_aborted) {
+          debug_log(cout << "[x] Accept error: " << ec << endl;);
+          if (int delay = admission::instance().failed(ec.value(), acceptor_.native_handle())) {
+            retry_accept(delay);
+          } else {
+            do_accept();
+          }
         }
       });
   }
@@ -626,22 +3029,386 @@ private:
   boost::asio::io_context& io_context_;
   tcp::acceptor acceptor_;
   boost::asio::signal_set signal_;
+  io_context_pool *pool_;
+  vector<std::unique_ptr<listener>> listeners_;
+  std::unique_ptr<metrics_server> metrics_;
+  std::unique_ptr<boost::asio::local::stream_protocol::acceptor> upgrade_acceptor_;
+  std::shared_ptr<upgrade_socket> upgrade_peer_;  // Handoff in progress
+  boost::asio::steady_timer accept_timer_;  // Backoff and session limit
+  bool accept_paused_;
+  bool draining_;
+  boost::asio::steady_timer drain_timer_;
+  std::chrono::steady_clock::time_point drain_deadline_;
+  std::unordered_set<pid_t> children_;  // Fork mode
+#ifdef SOCKS_IO_URING
+  uring *uring_;
+  accept_op accept_op_;
+  bool accepting_;  // A multishot request is armed
+  bool stopping_;   // and cancelled for admission
+  int accept_delay_;
+#endif
+};
+
+static void usage()
+{
+  cout << "Usage: socks_server <port> [options]\n"
+       << "  -t, --threads <n>  serve connections on n worker threads\n"
+       << "  -f, --fork         fork a process per connection (default)\n"
+       << "  -c, --config <f>   firewall rules, reloaded on SIGHUP (default ./socks.conf)\n"
+       << "  -s, --splice       relay tunnels with splice(2) (Linux only)\n"
+       << "  --reuseport        with -t, a SO_REUSEPORT listener per worker thread\n"
+       << "  --pin-cpus         with -t, pin worker threads to CPUs\n"
+       << "  --incoming-cpu     with --reuseport, accept on the worker of the CPU that\n"
+       << "                     received the connection (implies --pin-cpus)\n"
+       << "  --relay-buffer-max <bytes>\n"
+       << "                     largest buffer per relay direction, up to 128 MiB\n"
+       << "                     (default 256 KiB)\n"
+       << "  --relay-memory-max <bytes>\n"
+       << "                     stop growing and reading ahead above this (default 512 MiB)\n"
+       << "  --dns-ttl <sec>    keep resolved names at most this long, 0 disables\n"
+       << "                     (default 60), with --dns-server shorter record TTLs win\n"
+       << "  --dns-negative-ttl <sec>\n"
+       << "                     keep failed lookups this long (default 5)\n"
+       << "  --dns-server <addr>[:<port>]\n"
+       << "                     resolve over UDP on the worker threads instead of with\n"
+       << "                     getaddrinfo, repeat for fallback servers (default port 53)\n"
+       << "  --dns-timeout <ms> wait this long for an answer before asking again (default 1000)\n"
+       << "  --dns-attempts <n> queries per name, taking turns over the servers (default 3)\n"
+       << "  --connect-delay <ms>\n"
+       << "                     stagger between connects to resolved addresses (default 250)\n"
+       << "  --handshake-timeout <sec>\n"
+       << "                     close clients that don't send a request, 0 disables (default 10)\n"
+       << "  --connect-timeout <sec>\n"
+       << "                     limit from request to reply, 0 disables (default 30)\n"
+       << "  --idle-timeout <sec>\n"
+       << "                     close tunnels without traffic, 0 disables (default 300)\n"
+       << "  --bind-ports <first>-<last>\n"
+       << "                     listening ports for BIND (default 21862-65535)\n"
+       << "  --access-log <file>\n"
+       << "                     request log, - for stdout (default) or none\n"
+       << "  --access-log-format <classic|line|binary>\n"
+       << "                     multi-line blocks (default), one line or raw records\n"
+       << "  --access-log-full <drop|block>\n"
+       << "                     when a worker's log ring is full (default drop)\n"
+       << "  --metrics [<addr>:]<port>\n"
+       << "                     serve Prometheus metrics over HTTP (default addr 127.0.0.1)\n"
+       << "  --upgrade-socket <path>\n"
+       << "                     take the listeners over from a server running with the same\n"
+       << "                     path, then wait there to hand them to the next one\n"
+       << "  --drain-timeout <sec>\n"
+       << "                     after a handoff, time left for open tunnels (default 30)\n"
+       << "  --max-sessions <n> stop accepting at n open sessions and resume below 90%,\n"
+       << "                     0 for no limit (default 0)\n";
+#ifdef SOCKS_IO_URING
+  cout << "Built with IO_ENGINE=uring: with -t, accepting and relaying run on io_uring\n";
+#endif
+}
+
+// Long options without a short form
+enum {
+  opt_relay_buffer_max = 0x100,
+  opt_relay_memory_max,
+  opt_dns_ttl,
+  opt_dns_negative_ttl,
+  opt_dns_server,
+  opt_dns_timeout,
+  opt_dns_attempts,
+  opt_connect_delay,
+  opt_handshake_timeout,
+  opt_connect_timeout,
+  opt_idle_timeout,
+  opt_bind_ports,
+  opt_access_log,
+  opt_access_log_format,
+  opt_access_log_full,
+  opt_metrics,
+  opt_reuseport,
+  opt_pin_cpus,
+  opt_incoming_cpu,
+  opt_upgrade_socket,
+  opt_drain_timeout,
+  opt_max_sessions,
 };
 
+// a.b.c.d, a.b.c.d:port, an IPv6 address or [IPv6]:port
+static bool parse_dns_server(const string& arg, udp::endpoint& server)
+{
+  string host = arg;
+  int port = 53;
+  size_t colon = arg.rfind(':');
+  boost::system::error_code ec;
+
+  if (!arg.empty() && arg[0] == '[') {
+    size_t close = arg.find(']');
+    if (close == string::npos || (close + 1 != arg.size() && arg[close + 1] != ':')) {
+      return false;
+    }
+    host = arg.substr(1, close - 1);
+    if (close + 1 != arg.size()) {
+      port = std::atoi(arg.c_str() + close + 2);
+    }
+  } else if (colon != string::npos && arg.find(':') == colon) {
+    host = arg.substr(0, colon);
+    port = std::atoi(arg.c_str() + colon + 1);
+  }
+
+  boost::asio::ip::address address = boost::asio::ip::make_address(host, ec);
+  if (ec || port <= 0 || port > 0xffff) {
+    return false;
+  }
+  server = udp::endpoint(address, port);
+  return true;
+}
+
+static int parse_options(int argc, char* argv[])
+{
+  static const struct option long_options[] = {
+    { "threads", required_argument, 0, 't' },
+    { "fork",    no_argument,       0, 'f' },
+    { "config",  required_argument, 0, 'c' },
+    { "splice",  no_argument,       0, 's' },
+    { "relay-buffer-max", required_argument, 0, opt_relay_buffer_max },
+    { "relay-memory-max", required_argument, 0, opt_relay_memory_max },
+    { "dns-ttl",          required_argument, 0, opt_dns_ttl },
+    { "dns-negative-ttl", required_argument, 0, opt_dns_negative_ttl },
+    { "dns-server",       required_argument, 0, opt_dns_server },
+    { "dns-timeout",      required_argument, 0, opt_dns_timeout },
+    { "dns-attempts",     required_argument, 0, opt_dns_attempts },
+    { "connect-delay",    required_argument, 0, opt_connect_delay },
+    { "handshake-timeout", required_argument, 0, opt_handshake_timeout },
+    { "connect-timeout",   required_argument, 0, opt_connect_timeout },
+    { "idle-timeout",      required_argument, 0, opt_idle_timeout },
+    { "bind-ports",       required_argument, 0, opt_bind_ports },
+    { "access-log",        required_argument, 0, opt_access_log },
+    { "access-log-format", required_argument, 0, opt_access_log_format },
+    { "access-log-full",   required_argument, 0, opt_access_log_full },
+    { "metrics",           required_argument, 0, opt_metrics },
+    { "reuseport",         no_argument,       0, opt_reuseport },
+    { "pin-cpus",          no_argument,       0, opt_pin_cpus },
+    { "incoming-cpu",      no_argument,       0, opt_incoming_cpu },
+    { "upgrade-socket",    required_argument, 0, opt_upgrade_socket },
+    { "drain-timeout",     required_argument, 0, opt_drain_timeout },
+    { "max-sessions",      required_argument, 0, opt_max_sessions },
+    { 0, 0, 0, 0 }
+  };
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "t:fc:s", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 't':
+        g_config.threads = std::atoi(optarg);
+        if (g_config.threads <= 0) {
+          cerr << "[x] Invalid thread count: " << optarg << endl;
+          return -1;
+        }
+        break;
+      case 'f':
+        g_config.threads = 0;
+        break;
+      case 'c':
+        g_config.firewall_file = optarg;
+        break;
+      case 's':
+        g_config.splice = true;
+        break;
+      case opt_relay_buffer_max:
+        g_config.relay_buffer_max = std::strtoul(optarg, NULL, 0);
+        // The pool has no buffers past max_size
+        if (g_config.relay_buffer_max < relay_channel::min_size ||
+            g_config.relay_buffer_max > relay_channel::max_size) {
+          cerr << "[x] Relay buffer must be between " << relay_channel::min_size << " and "
+               << relay_channel::max_size << " bytes" << endl;
+          return -1;
+        }
+        break;
+      case opt_relay_memory_max:
+        g_config.relay_memory_max = std::strtoul(optarg, NULL, 0);
+        break;
+      case opt_dns_ttl:
+        dns_cache::instance().ttl = std::chrono::seconds(std::atoi(optarg));
+        break;
+      case opt_dns_negative_ttl:
+        dns_cache::instance().negative_ttl = std::chrono::seconds(std::atoi(optarg));
+        break;
+      case opt_dns_server: {
+        udp::endpoint server;
+        if (!parse_dns_server(optarg, server)) {
+          cerr << "[x] Invalid DNS server: " << optarg << endl;
+          return -1;
+        }
+        dns_client::options().servers.push_back(server);
+        break;
+      }
+      case opt_dns_timeout:
+        dns_client::options().timeout = std::chrono::milliseconds(std::atoi(optarg));
+        if (dns_client::options().timeout.count() <= 0) {
+          cerr << "[x] Invalid DNS timeout: " << optarg << endl;
+          return -1;
+        }
+        break;
+      case opt_dns_attempts:
+        dns_client::options().attempts = std::atoi(optarg);
+        if (dns_client::options().attempts <= 0) {
+          cerr << "[x] Invalid DNS attempts: " << optarg << endl;
+          return -1;
+        }
+        break;
+      case opt_connect_delay:
+        g_config.connect_delay = std::chrono::milliseconds(std::atoi(optarg));
+        break;
+      case opt_handshake_timeout:
+        g_config.handshake_timeout = std::chrono::seconds(std::atoi(optarg));
+        break;
+      case opt_connect_timeout:
+        g_config.connect_timeout = std::chrono::seconds(std::atoi(optarg));
+        break;
+      case opt_idle_timeout:
+        g_config.idle_timeout = std::chrono::seconds(std::atoi(optarg));
+        break;
+      case opt_bind_ports: {
+        int first = 0;
+        int last = 0;
+        if (sscanf(optarg, "%d-%d", &first, &last) != 2 ||
+            first <= 0 || last > 0xffff || first > last) {
+          cerr << "[x] Invalid BIND port range: " << optarg << endl;
+          return -1;
+        }
+        port_allocator::instance().configure(first, last);
+        break;
+      }
+      case opt_access_log:
+        if (!access_log::instance().open(optarg)) {
+          cerr << "[x] Can't open access log: " << optarg << endl;
+          return -1;
+        }
+        break;
+      case opt_access_log_format:
+        if (string(optarg) == "classic") {
+          access_log::instance().set_format(access_log::classic);
+        } else if (string(optarg) == "line") {
+          access_log::instance().set_format(access_log::line);
+        } else if (string(optarg) == "binary") {
+          access_log::instance().set_format(access_log::binary);
+        } else {
+          cerr << "[x] Unknown access log format: " << optarg << endl;
+          return -1;
+        }
+        break;
+      case opt_access_log_full:
+        if (string(optarg) == "drop") {
+          access_log::instance().set_policy(access_log::drop);
+        } else if (string(optarg) == "block") {
+          access_log::instance().set_policy(access_log::block);
+        } else {
+          cerr << "[x] Unknown access log policy: " << optarg << endl;
+          return -1;
+        }
+        break;
+      case opt_metrics: {
+        string arg = optarg;
+        size_t colon = arg.rfind(':');
+        if (colon != string::npos) {
+          g_config.metrics_address = arg.substr(0, colon);
+          arg = arg.substr(colon + 1);
+        }
+        g_config.metrics_port = std::atoi(arg.c_str());
+        if (g_config.metrics_port == 0) {
+          cerr << "[x] Invalid metrics port: " << optarg << endl;
+          return -1;
+        }
+        break;
+      }
+      case opt_reuseport:
+        g_config.reuseport = true;
+        break;
+      case opt_pin_cpus:
+        g_config.pin_cpus = true;
+        break;
+      case opt_incoming_cpu:
+        g_config.incoming_cpu = true;
+        g_config.pin_cpus = true;
+        break;
+      case opt_upgrade_socket:
+        g_config.upgrade_socket = optarg;
+        break;
+      case opt_drain_timeout:
+        g_config.drain_timeout = std::chrono::seconds(std::atoi(optarg));
+        break;
+      case opt_max_sessions:
+        admission::instance().set_max_sessions(std::strtoul(optarg, NULL, 0));
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    return -1;
+  }
+
+  return 0;
+}
+
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 2) {
-      cout << "Usage: socks_server <port>\n";
+    if (parse_options(argc, argv) == -1) {
+      usage();
+      return 1;
+    }
+
+    // A write to a peer that went away reports EPIPE, it must not take
+    // every tunnel of the process down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // Serving with no rules would reject every request, better not to start
+    if (!firewall::reload(g_config.firewall_file)) {
+      cerr << "[x] Can't load " << g_config.firewall_file << endl;
       return 1;
     }
+    warn_fork_limits();
 
     boost::asio::io_context io_context;
+    handoff::sockets inherited;
+    int takeover = -1;
+
+    // A server already running on the upgrade socket hands its listeners over
+    if (!g_config.upgrade_socket.empty()) {
+      takeover = handoff::take_over(g_config.upgrade_socket, inherited);
+      if (takeover != -1) {
+        cerr << "[*] Took over " << inherited.listeners.size() << " listeners" << endl;
+      }
+    }
+
+    if (g_config.threads) {
+      io_context_pool pool(g_config.threads);
+      server s(io_context, std::atoi(argv[optind]), &pool, inherited);
 
-    server s(io_context, std::atoi(argv[1]));
+      if (takeover != -1) {
+        handoff::release(takeover);
+      }
+      s.listen_for_upgrade();
+
+      // Fork mode writes log records directly, threads can't survive fork()
+      access_log::instance().start();
+
+      pool.start();
+      io_context.run();
+      pool.stop();
+      pool.join();
+
+      access_log::instance().stop();
+    } else {
+      server s(io_context, std::atoi(argv[optind]), NULL, inherited);
+
+      if (takeover != -1) {
+        handoff::release(takeover);
+      }
+      s.listen_for_upgrade();
 
-    io_context.run();
+      io_context.run();
+    }
   }
   catch (std::exception& e)
   {
@@ -649,4 +3416,4 @@ int main(int argc, char* argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,234 @@
+//
+// timer_wheel.hpp
+// ~~~~~~~~~~~~~~~
+//
+// Per-thread hashed timing wheel for coarse session timeouts.
+//
+// Entries are intrusive list nodes hashed into slots by their expiry tick,
+// so arming and cancelling are O(1) and never allocate. One steady_timer per
+// thread drives the wheel and only runs while something is armed. Each tick
+// looks at a single slot; entries that belong to a later lap stay put.
+//
+
+#ifndef SOCKS_TIMER_WHEEL_HPP
+#define SOCKS_TIMER_WHEEL_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "handler_memory.hpp"
+
+class timer_wheel
+{
+public:
+  typedef std::chrono::steady_clock clock;
+
+  enum { slots = 1024, tick_ms = 100 };
+
+  struct link {
+    link()
+      : prev(this),
+        next(this)
+    {
+    }
+
+    void unlink()
+    {
+      prev->next = next;
+      next->prev = prev;
+      prev = next = this;
+    }
+
+    void insert_before(link& pos)
+    {
+      prev = pos.prev;
+      next = &pos;
+      pos.prev->next = this;
+      pos.prev = this;
+    }
+
+    link *prev;
+    link *next;
+  };
+
+  // Embed one in the object that times out, it unlinks itself when destroyed
+  class entry
+    : private link
+  {
+  public:
+    entry()
+      : wheel_(NULL),
+        deadline_(0)
+    {
+    }
+
+    virtual ~entry()
+    {
+      cancel();
+    }
+
+    bool armed() const
+    {
+      return wheel_ != NULL;
+    }
+
+    void cancel()
+    {
+      if (wheel_) {
+        unlink();
+        --wheel_->size_;
+        wheel_ = NULL;
+      }
+    }
+
+  protected:
+    virtual void expired() = 0;
+
+  private:
+    friend class timer_wheel;
+
+    entry(const entry&);
+    entry& operator=(const entry&);
+
+    timer_wheel *wheel_;
+    uint64_t deadline_;
+  };
+
+  static clock::duration resolution()
+  {
+    return std::chrono::milliseconds(tick_ms);
+  }
+
+  // The calling thread's wheel, driven by the io_context it runs. Never
+  // freed, sessions may outlive the thread's other locals.
+  static timer_wheel& local(boost::asio::io_context& io_context)
+  {
+    static thread_local timer_wheel *wheel = NULL;
+
+    if (!wheel) {
+      wheel = new timer_wheel(io_context);
+    }
+    return *wheel;
+  }
+
+  explicit timer_wheel(boost::asio::io_context& io_context)
+    : timer_(io_context),
+      origin_(clock::now()),
+      now_(0),
+      size_(0),
+      running_(false)
+  {
+  }
+
+  // Fires after at least `after`, rounded up to whole ticks
+  void schedule(entry& e, clock::duration after)
+  {
+    e.cancel();
+
+    if (!running_) {
+      now_ = current_tick();
+    }
+
+    uint64_t ticks = (after + resolution() - clock::duration(1)) / resolution();
+
+    e.deadline_ = now_ + (ticks ? ticks : 1);
+    e.wheel_ = this;
+    e.insert_before(slots_[e.deadline_ % slots]);
+    ++size_;
+
+    if (!running_) {
+      running_ = true;
+      arm();
+    }
+  }
+
+  // Tick count as of the last turn, cheap enough for every read
+  uint64_t now() const
+  {
+    return now_;
+  }
+
+  size_t size() const
+  {
+    return size_;
+  }
+
+private:
+  uint64_t current_tick() const
+  {
+    return (clock::now() - origin_) / resolution();
+  }
+
+  void arm()
+  {
+    timer_.expires_at(origin_ + resolution() * (now_ + 1));
+    timer_.async_wait(recycle(
+      [this](boost::system::error_code ec)
+      {
+        if (ec) {
+          running_ = false;
+          return;
+        }
+        turn();
+      }));
+  }
+
+  void turn()
+  {
+    uint64_t target = current_tick();
+
+    // Asleep for more than a lap, every slot is due anyway
+    if (target - now_ > slots) {
+      now_ = target - slots;
+    }
+
+    while (now_ < target) {
+      ++now_;
+      expire(slots_[now_ % slots]);
+    }
+
+    if (size_) {
+      arm();
+    } else {
+      running_ = false;
+    }
+  }
+
+  void expire(link& slot)
+  {
+    link due;
+
+    // Work on a detached list, expired() may re-arm into this slot
+    if (slot.next == &slot) {
+      return;
+    }
+    due.next = slot.next;
+    due.prev = slot.prev;
+    due.next->prev = &due;
+    due.prev->next = &due;
+    slot.prev = slot.next = &slot;
+
+    while (due.next != &due) {
+      entry& e = static_cast<entry&>(*due.next);
+
+      e.unlink();
+      if (e.deadline_ > now_) {
+        e.insert_before(slot);
+        continue;
+      }
+      e.wheel_ = NULL;
+      --size_;
+      e.expired();
+    }
+  }
+
+  boost::asio::steady_timer timer_;
+  clock::time_point origin_;
+  uint64_t now_;
+  size_t size_;
+  bool running_;
+  link slots_[slots];
+};
+
+#endif // SOCKS_TIMER_WHEEL_HPP
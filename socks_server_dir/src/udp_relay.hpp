@@ -0,0 +1,345 @@
+//
+// udp_relay.hpp
+// ~~~~~~~~~~~~~
+//
+// Batched datagram I/O for SOCKS5 UDP ASSOCIATE.
+//
+// A batch borrows one buffer from the thread's pool and cuts it into slots.
+// recvmmsg fills every slot in one call, and each slot keeps room in front of
+// the payload so the SOCKS5 UDP header can be prepended in place. Datagrams
+// to send are queued and go out with one sendmmsg. Runs of datagrams to the
+// same destination are coalesced into one UDP_SEGMENT (GSO) send where the
+// kernel takes it.
+//
+
+#ifndef SOCKS_UDP_RELAY_HPP
+#define SOCKS_UDP_RELAY_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include "buffer_pool.hpp"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// RSV RSV FRAG ATYP DST.ADDR DST.PORT in front of every relayed datagram
+struct socks5_udp_header {
+  enum { atyp_ipv4 = 1, atyp_domain = 3, atyp_ipv6 = 4 };
+  enum { max_prepend = 4 + 16 + 2 };
+
+  // Returns the header length, 0 when it is malformed
+  size_t parse(const char *data, size_t length)
+  {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t addr_length;
+    size_t offset = 4;
+
+    if (length < 4) {
+      return 0;
+    }
+
+    frag = p[2];
+    atyp = p[3];
+
+    if (atyp == atyp_ipv4) {
+      addr_length = 4;
+    } else if (atyp == atyp_ipv6) {
+      addr_length = 16;
+    } else if (atyp == atyp_domain && length > 5 && p[4] != 0) {
+      addr_length = p[4];
+      offset = 5;
+    } else {
+      return 0;
+    }
+
+    if (length < offset + addr_length + 2) {
+      return 0;
+    }
+
+    if (atyp == atyp_domain) {
+      memcpy(domain, p + offset, addr_length);
+      domain[addr_length] = 0;
+    } else {
+      memcpy(addr, p + offset, addr_length);
+    }
+    port = (p[offset + addr_length] << 8) | p[offset + addr_length + 1];
+
+    return offset + addr_length + 2;
+  }
+
+  // Writes the header for a datagram from `from` so that it ends right
+  // before `payload`, returns its length
+  static size_t prepend(const sockaddr_storage& from, char *payload)
+  {
+    if (from.ss_family == AF_INET6) {
+      const sockaddr_in6& sa = (const sockaddr_in6&)from;
+      uint8_t *p = (uint8_t *)payload - (4 + 16 + 2);
+
+      p[3] = atyp_ipv6;
+      memcpy(p + 4, &sa.sin6_addr, 16);
+      memcpy(p + 20, &sa.sin6_port, 2);
+      p[0] = p[1] = p[2] = 0;
+      return 4 + 16 + 2;
+    }
+
+    const sockaddr_in& sa = (const sockaddr_in&)from;
+    uint8_t *p = (uint8_t *)payload - (4 + 4 + 2);
+
+    p[3] = atyp_ipv4;
+    memcpy(p + 4, &sa.sin_addr, 4);
+    memcpy(p + 8, &sa.sin_port, 2);
+    p[0] = p[1] = p[2] = 0;
+    return 4 + 4 + 2;
+  }
+
+  uint8_t frag;
+  uint8_t atyp;
+  uint8_t addr[16];  // Network byte order
+  char domain[256];
+  uint16_t port;     // Host byte order
+};
+
+class udp_batch
+{
+public:
+  // Datagrams that don't fit a slot are reported truncated. GSO is only
+  // used for segments that fit an Ethernet MTU, bigger ones would have to be
+  // fragmented and the kernel refuses them.
+  enum {
+    slots = 16,
+    slot_size = 0x1000,
+    headroom = socks5_udp_header::max_prepend,
+    max_gso_segment = 1472,
+    max_gso_segments = 64,
+    max_gso_bytes = 0xffff - 8 - 40
+  };
+
+  struct datagram {
+    char *data;  // headroom bytes of slack in front
+    size_t length;
+    bool truncated;
+    sockaddr_storage peer;
+    socklen_t peer_length;
+  };
+
+  udp_batch()
+    : buffer_(NULL),
+      capacity_(0),
+      queued_(0)
+  {
+  }
+
+  ~udp_batch()
+  {
+    release();
+  }
+
+  udp_batch(const udp_batch&) = delete;
+  udp_batch& operator=(const udp_batch&) = delete;
+
+  // Non-blocking, returns the number of datagrams read, 0 when none were
+  // waiting and -1 on error
+  int receive(int fd)
+  {
+    mmsghdr msgs[slots];
+    iovec iov[slots];
+
+    if (!buffer_) {
+      buffer_ = buffer_pool::local().acquire(slots * slot_size, capacity_);
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < slots; ++i) {
+      iov[i].iov_base = buffer_ + i * slot_size + headroom;
+      iov[i].iov_len = slot_size - headroom;
+      msgs[i].msg_hdr.msg_name = &received_[i].peer;
+      msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(fd, msgs, slots, MSG_DONTWAIT, NULL);
+
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      datagram& d = received_[i];
+
+      d.data = (char *)iov[i].iov_base;
+      d.length = msgs[i].msg_len;
+      d.truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+      d.peer_length = msgs[i].msg_hdr.msg_namelen;
+    }
+    return n;
+  }
+
+  datagram& operator[](int i)
+  {
+    return received_[i];
+  }
+
+  // Queues a datagram for the next flush(), data has to stay valid until
+  // then. Returns false when the queue is full.
+  bool send(const char *data, size_t length, const sockaddr *to, socklen_t to_length)
+  {
+    if (queued_ == slots) {
+      return false;
+    }
+
+    outgoing& o = queue_[queued_++];
+    o.data = data;
+    o.length = length;
+    memcpy(&o.to, to, to_length);
+    o.to_length = to_length;
+    return true;
+  }
+
+  // Sends everything queued, returns how many datagrams were dropped
+  size_t flush(int fd)
+  {
+    size_t dropped = 0;
+    bool gso = gso_enabled().load(std::memory_order_relaxed);
+    int next = 0;
+
+    while (next < queued_) {
+      mmsghdr msgs[slots];
+      iovec iov[slots];
+      char control[slots][CMSG_SPACE(sizeof(uint16_t))];
+      int first[slots];
+      int count[slots];
+      int n = build(next, gso, msgs, iov, control, first, count);
+      int sent = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+
+      if (sent > 0) {
+        next = first[sent - 1] + count[sent - 1];
+        continue;
+      }
+
+      // The socket buffer is full, datagrams are allowed to get lost
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        dropped += queued_ - next;
+        break;
+      }
+
+      // No GSO on this path, send the run again one by one
+      if (count[0] > 1) {
+        if (errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+          gso_enabled().store(false, std::memory_order_relaxed);
+        }
+        gso = false;
+        continue;
+      }
+
+      dropped += count[0];
+      next += count[0];
+    }
+
+    queued_ = 0;
+    return dropped;
+  }
+
+  // Gives the slots back to the pool, an idle association holds no memory
+  void release()
+  {
+    if (buffer_) {
+      buffer_pool::local().release(buffer_, capacity_);
+      buffer_ = NULL;
+      capacity_ = 0;
+    }
+    queued_ = 0;
+  }
+
+  // Cleared for good once a send fails because of UDP_SEGMENT
+  static std::atomic<bool>& gso_enabled()
+  {
+    static std::atomic<bool> enabled(true);
+    return enabled;
+  }
+
+private:
+  struct outgoing {
+    const char *data;
+    size_t length;
+    sockaddr_storage to;
+    socklen_t to_length;
+  };
+
+  // One message per datagram, or per run of equal sized datagrams to the
+  // same destination (the last one may be shorter) when GSO is on
+  int build(int next, bool gso, mmsghdr *msgs, iovec *iov,
+            char (*control)[CMSG_SPACE(sizeof(uint16_t))], int *first, int *count)
+  {
+    int n = 0;
+    size_t bytes = 0;
+
+    memset(msgs, 0, sizeof(mmsghdr) * slots);
+
+    for (int i = next; i < queued_; ++i) {
+      const outgoing& o = queue_[i];
+
+      iov[i - next].iov_base = (void *)o.data;
+      iov[i - next].iov_len = o.length;
+
+      if (gso && n > 0) {
+        const outgoing& head = queue_[first[n - 1]];
+        const outgoing& last = queue_[i - 1];
+
+        if (head.length <= max_gso_segment &&
+            last.length == head.length &&
+            o.length <= head.length &&
+            count[n - 1] < max_gso_segments &&
+            bytes + o.length <= max_gso_bytes &&
+            o.to_length == head.to_length &&
+            memcmp(&o.to, &head.to, o.to_length) == 0) {
+          ++count[n - 1];
+          ++msgs[n - 1].msg_hdr.msg_iovlen;
+          bytes += o.length;
+          continue;
+        }
+      }
+
+      first[n] = i;
+      count[n] = 1;
+      msgs[n].msg_hdr.msg_name = (void *)&o.to;
+      msgs[n].msg_hdr.msg_namelen = o.to_length;
+      msgs[n].msg_hdr.msg_iov = &iov[i - next];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      bytes = o.length;
+      ++n;
+    }
+
+    for (int m = 0; m < n; ++m) {
+      if (count[m] > 1) {
+        msghdr& h = msgs[m].msg_hdr;
+        uint16_t segment = queue_[first[m]].length;
+
+        h.msg_control = control[m];
+        h.msg_controllen = sizeof(control[m]);
+        cmsghdr *cm = CMSG_FIRSTHDR(&h);
+        cm->cmsg_level = IPPROTO_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(segment));
+        memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+      }
+    }
+
+    return n;
+  }
+
+  char *buffer_;
+  size_t capacity_;
+  datagram received_[slots];
+  outgoing queue_[slots];
+  int queued_;
+};
+
+#endif // SOCKS_UDP_RELAY_HPP
@@ -0,0 +1,454 @@
+//
+// uring.hpp
+// ~~~~~~~~~
+//
+// Minimal io_uring engine living next to an asio io_context.
+//
+// One ring per thread, set up with raw syscalls. The ring signals an eventfd
+// that the io_context waits on, so completions are handled between ordinary
+// asio handlers. Requests queued while handlers run go out together in one
+// io_uring_enter. Receives pick their buffer from a provided-buffer ring and
+// the sends that forward the data go out straight from that buffer. Sends
+// use MSG_NOSIGNAL, a peer that went away is an error result and never a
+// SIGPIPE.
+//
+
+#ifndef SOCKS_URING_HPP
+#define SOCKS_URING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <ostream>
+#include <utility>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
+#include "handler_memory.hpp"
+
+// The kernel header uses anonymous structs and flexible arrays
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#include <linux/io_uring.h>
+#pragma GCC diagnostic pop
+
+class uring
+{
+public:
+  // Target of a request, user_data of the SQE points at it
+  class operation
+  {
+  public:
+    virtual ~operation() {}
+    virtual void complete(int res, unsigned flags) = 0;
+  };
+
+  enum { entries = 4096, buffers = 256, buffer_size = 0x8000, buffer_group = 0 };
+
+  // The calling thread's ring, driven by the io_context it runs. Never
+  // freed, like the thread's timer wheel.
+  static uring& local(boost::asio::io_context& io_context)
+  {
+    static thread_local uring *ring = NULL;
+
+    if (!ring) {
+      ring = new uring(io_context);
+    }
+    return *ring;
+  }
+
+  explicit uring(boost::asio::io_context& io_context)
+    : io_context_(io_context),
+      event_(io_context),
+      ring_fd_(-1),
+      event_fd_(-1),
+      sq_ring_(NULL),
+      cq_ring_(NULL),
+      sqes_(NULL),
+      ring_size_(0),
+      sqes_size_(0),
+      arena_(NULL),
+      buf_ring_(NULL),
+      queued_(0),
+      flush_posted_(false),
+      ok_(false)
+  {
+    ok_ = setup();
+    if (ok_) {
+      wait();
+    } else {
+      teardown();
+    }
+  }
+
+  // False when the kernel refused any part of the setup
+  bool ok() const
+  {
+    return ok_;
+  }
+
+  // One request, re-armed by the caller when the CQE lacks IORING_CQE_F_MORE
+  void accept_multishot(int fd, operation *op)
+  {
+    io_uring_sqe *sqe = get_sqe(IORING_OP_ACCEPT, fd, op);
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+  }
+
+  // One connection per request, for callers that have to look at every one
+  // before taking the next
+  void accept(int fd, operation *op)
+  {
+    io_uring_sqe *sqe = get_sqe(IORING_OP_ACCEPT, fd, op);
+
+    sqe->accept_flags = SOCK_CLOEXEC;
+  }
+
+  // The CQE carries the buffer id, see buffer_id()
+  void recv(int fd, operation *op)
+  {
+    io_uring_sqe *sqe = get_sqe(IORING_OP_RECV, fd, op);
+
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->len = buffer_size;
+  }
+
+  void send(int fd, const char *data, size_t length, operation *op)
+  {
+    io_uring_sqe *sqe = get_sqe(IORING_OP_SEND, fd, op);
+
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+
+  // Everything pending on fd completes with -ECANCELED, receives still
+  // waiting for a buffer included
+  void cancel_fd(int fd)
+  {
+    io_uring_sqe *sqe = get_sqe(IORING_OP_ASYNC_CANCEL, fd, NULL);
+
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+
+    for (auto it = starved_.begin(); it != starved_.end(); ) {
+      if (it->first != fd) {
+        ++it;
+        continue;
+      }
+      operation *op = it->second;
+      it = starved_.erase(it);
+      boost::asio::post(io_context_, [op]() { op->complete(-ECANCELED, 0); });
+    }
+  }
+
+  // A receive that got -ENOBUFS, it's resubmitted when a buffer comes back
+  void recv_when_buffered(int fd, operation *op)
+  {
+    starved_.push_back(std::make_pair(fd, op));
+  }
+
+  static bool has_buffer(unsigned flags)
+  {
+    return flags & IORING_CQE_F_BUFFER;
+  }
+
+  static unsigned buffer_id(unsigned flags)
+  {
+    return flags >> IORING_CQE_BUFFER_SHIFT;
+  }
+
+  char *buffer(unsigned bid)
+  {
+    return arena_ + (size_t)bid * buffer_size;
+  }
+
+  // Hands a received buffer back to the kernel
+  void recycle(unsigned bid)
+  {
+    io_uring_buf& buf = buf_ring_[buf_tail_ & (buffers - 1)];
+
+    buf.addr = (uint64_t)(uintptr_t)buffer(bid);
+    buf.len = buffer_size;
+    buf.bid = bid;
+    ++buf_tail_;
+    __atomic_store_n(buf_ring_tail(), buf_tail_, __ATOMIC_RELEASE);
+
+    if (!starved_.empty()) {
+      std::pair<int, operation *> waiter = starved_.front();
+      starved_.pop_front();
+      recv(waiter.first, waiter.second);
+    }
+  }
+
+  // io_uring_enter calls and completions, all rings of the process
+  static std::atomic<uint64_t>& submits()
+  {
+    static std::atomic<uint64_t> n(0);
+    return n;
+  }
+
+  static std::atomic<uint64_t>& completions()
+  {
+    static std::atomic<uint64_t> n(0);
+    return n;
+  }
+
+  static void dump_stats(std::ostream& os)
+  {
+    os << "uring submits=" << submits() << " completions=" << completions() << "\n";
+  }
+
+private:
+  bool setup()
+  {
+    io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER;
+    ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd_ == -1 && errno == EINVAL) {
+      memset(&params, 0, sizeof(params));
+      ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring_fd_ == -1 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    ring_size_ = std::max(sq_size, cq_size);
+    sq_ring_ = (char *)mmap(NULL, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      sq_ring_ = NULL;
+      return false;
+    }
+    cq_ring_ = sq_ring_;
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *)mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      sqes_ = NULL;
+      return false;
+    }
+
+    sq_tail_ = (unsigned *)(sq_ring_ + params.sq_off.tail);
+    sq_mask_ = *(unsigned *)(sq_ring_ + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_head_ = (unsigned *)(sq_ring_ + params.sq_off.head);
+    cq_head_ = (unsigned *)(cq_ring_ + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq_ring_ + params.cq_off.tail);
+    cq_mask_ = *(unsigned *)(cq_ring_ + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq_ring_ + params.cq_off.cqes);
+    local_tail_ = *sq_tail_;
+
+    // SQ slots map 1:1 to SQEs
+    unsigned *array = (unsigned *)(sq_ring_ + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) {
+      array[i] = i;
+    }
+
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ == -1 || enter_register(IORING_REGISTER_EVENTFD, &event_fd_, 1) == -1) {
+      return false;
+    }
+
+    arena_ = (char *)mmap(NULL, (size_t)buffers * buffer_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena_ == MAP_FAILED) {
+      arena_ = NULL;
+      return false;
+    }
+
+    buf_ring_ = (io_uring_buf *)mmap(NULL, buffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring_ == MAP_FAILED) {
+      buf_ring_ = NULL;
+      return false;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring_;
+    reg.ring_entries = buffers;
+    reg.bgid = buffer_group;
+    if (enter_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+      return false;
+    }
+
+    buf_tail_ = 0;
+    for (unsigned bid = 0; bid < buffers; ++bid) {
+      recycle(bid);
+    }
+
+    event_.assign(event_fd_);
+    return true;
+  }
+
+  // Undoes whatever part of setup() succeeded
+  void teardown()
+  {
+    if (buf_ring_) {
+      munmap(buf_ring_, buffers * sizeof(io_uring_buf));
+      buf_ring_ = NULL;
+    }
+    if (arena_) {
+      munmap(arena_, (size_t)buffers * buffer_size);
+      arena_ = NULL;
+    }
+    if (sqes_) {
+      munmap(sqes_, sqes_size_);
+      sqes_ = NULL;
+    }
+    if (sq_ring_) {
+      munmap(sq_ring_, ring_size_);
+      sq_ring_ = cq_ring_ = NULL;
+    }
+    if (event_fd_ != -1) {
+      ::close(event_fd_);
+      event_fd_ = -1;
+    }
+    if (ring_fd_ != -1) {
+      ::close(ring_fd_);
+      ring_fd_ = -1;
+    }
+  }
+
+  int enter_register(unsigned opcode, void *arg, unsigned nr_args)
+  {
+    return syscall(__NR_io_uring_register, ring_fd_, opcode, arg, nr_args);
+  }
+
+  // The tail shares its slot with bufs[0].resv
+  uint16_t *buf_ring_tail()
+  {
+    return &buf_ring_[0].resv;
+  }
+
+  io_uring_sqe *get_sqe(uint8_t opcode, int fd, operation *op)
+  {
+    if (local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+      submit();
+    }
+
+    io_uring_sqe *sqe = &sqes_[local_tail_ & sq_mask_];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    ++local_tail_;
+    ++queued_;
+
+    // Everything queued by the handlers that run until then goes in one call
+    if (!flush_posted_) {
+      flush_posted_ = true;
+      boost::asio::post(io_context_, [this]()
+        {
+          flush_posted_ = false;
+          submit();
+        });
+    }
+    return sqe;
+  }
+
+  void submit()
+  {
+    if (queued_ == 0) {
+      return;
+    }
+
+    __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+
+    while (queued_) {
+      int n = syscall(__NR_io_uring_enter, ring_fd_, queued_, 0, 0, NULL, 0);
+
+      if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+          continue;
+        }
+        break;
+      }
+      queued_ -= n;
+    }
+    submits().fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void wait()
+  {
+    event_.async_wait(boost::asio::posix::stream_descriptor::wait_read, ::recycle(
+      [this](boost::system::error_code ec)
+      {
+        if (ec) {
+          return;
+        }
+
+        uint64_t count;
+        if (read(event_fd_, &count, sizeof(count)) == -1) {
+          // Spurious, the CQ is checked anyway
+        }
+
+        reap();
+        submit();
+        wait();
+      }));
+  }
+
+  void reap()
+  {
+    unsigned head = *cq_head_;
+    uint64_t n = 0;
+
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+
+      ++head;
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      ++n;
+
+      operation *op = (operation *)(uintptr_t)cqe.user_data;
+      if (op) {
+        op->complete(cqe.res, cqe.flags);
+      }
+    }
+    completions().fetch_add(n, std::memory_order_relaxed);
+  }
+
+  boost::asio::io_context& io_context_;
+  boost::asio::posix::stream_descriptor event_;
+  int ring_fd_;
+  int event_fd_;
+  char *sq_ring_;
+  char *cq_ring_;
+  io_uring_sqe *sqes_;
+  size_t ring_size_;
+  size_t sqes_size_;
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned local_tail_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe *cqes_;
+  char *arena_;
+  io_uring_buf *buf_ring_;
+  uint16_t buf_tail_;
+  unsigned queued_;
+  bool flush_posted_;
+  bool ok_;
+  std::deque<std::pair<int, operation *>> starved_;
+};
+
+#endif // SOCKS_URING_HPP